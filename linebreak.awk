@@ -0,0 +1,197 @@
+# Generate linebreak.h from the Unicode LineBreak.txt data file (UAX #14).
+#
+# Usage: awk -f linebreak.awk < LineBreak.txt > linebreak.h
+#
+# The output is a two-stage lookup table (trie) of line-break classes for all
+# code points and a pair table of direct break opportunities derived from the
+# UAX #14 rules. Classes which are not used by webdump are resolved here
+# (rule LB1): AI, SG, SA and XX are AL, CJ is NS and the mandatory break and
+# space classes are treated as ZW: these are handled separately anyway.
+
+function hex(s,    i, n, c) {
+	n = 0;
+	s = toupper(s);
+	for (i = 1; i <= length(s); i++) {
+		c = index("0123456789ABCDEF", substr(s, i, 1));
+		if (!c)
+			break;
+		n = n * 16 + c - 1;
+	}
+	return n;
+}
+
+function resolve(c) {
+	if (c == "AI" || c == "SG" || c == "SA" || c == "XX")
+		return "AL";
+	if (c == "CJ")
+		return "NS";
+	if (c == "BK" || c == "CR" || c == "LF" || c == "NL" || c == "SP")
+		return "ZW";
+	return c;
+}
+
+# is a direct break allowed between class a and b? (no spaces in-between).
+function isbreak(a, b) {
+	if (b == "ZW") return 0;                                        # LB7
+	if (a == "ZW") return 1;                                        # LB8
+	if (a == "ZWJ") return 0;                                       # LB8a
+	if (b == "CM" || b == "ZWJ") return 0;                          # LB9
+	if (a == "WJ" || b == "WJ") return 0;                           # LB11
+	if (a == "GL") return 0;                                        # LB12
+	if (b == "GL" && a != "BA" && a != "HY") return 0;              # LB12a
+	if (b == "CL" || b == "CP" || b == "EX" || b == "IS" || b == "SY")
+		return 0;                                               # LB13
+	if (a == "OP") return 0;                                        # LB14
+	if (a == "QU" && b == "OP") return 0;                           # LB15
+	if ((a == "CL" || a == "CP") && b == "NS") return 0;            # LB16
+	if (a == "B2" && b == "B2") return 0;                           # LB17
+	if (a == "QU" || b == "QU") return 0;                           # LB19
+	if (a == "CB" || b == "CB") return 1;                           # LB20
+	if (b == "BA" || b == "HY" || b == "NS" || a == "BB") return 0; # LB21
+	if (a == "SY" && b == "HL") return 0;                           # LB21b
+	if (b == "IN") return 0;                                        # LB22
+	if (isalpha(a) && b == "NU") return 0;                          # LB23
+	if (a == "NU" && isalpha(b)) return 0;
+	if (a == "PR" && (b == "ID" || b == "EB" || b == "EM")) return 0; # LB23a
+	if ((a == "ID" || a == "EB" || a == "EM") && b == "PO") return 0;
+	if ((a == "PR" || a == "PO") && isalpha(b)) return 0;           # LB24
+	if (isalpha(a) && (b == "PR" || b == "PO")) return 0;
+	if ((a == "CL" || a == "CP" || a == "NU") && (b == "PO" || b == "PR"))
+		return 0;                                               # LB25
+	if ((a == "PO" || a == "PR") && (b == "OP" || b == "NU")) return 0;
+	if ((a == "HY" || a == "IS" || a == "NU" || a == "SY") && b == "NU")
+		return 0;
+	if (a == "JL" && (b == "JL" || b == "JV" || b == "H2" || b == "H3"))
+		return 0;                                               # LB26
+	if ((a == "JV" || a == "H2") && (b == "JV" || b == "JT")) return 0;
+	if ((a == "JT" || a == "H3") && b == "JT") return 0;
+	if (ishangul(a) && b == "PO") return 0;                         # LB27
+	if (a == "PR" && ishangul(b)) return 0;
+	if (isalpha(a) && isalpha(b)) return 0;                         # LB28
+	if (a == "IS" && isalpha(b)) return 0;                          # LB29
+	if ((isalpha(a) || a == "NU") && b == "OP") return 0;           # LB30
+	if (a == "CP" && (isalpha(b) || b == "NU")) return 0;
+	if (a == "RI" && b == "RI") return 0;                           # LB30a
+	if (a == "EB" && b == "EM") return 0;                           # LB30b
+	return 1;                                                       # LB31
+}
+
+function isalpha(c) {
+	return c == "AL" || c == "HL";
+}
+
+function ishangul(c) {
+	return c == "JL" || c == "JV" || c == "JT" || c == "H2" || c == "H3";
+}
+
+BEGIN {
+	FS = "[;#]";
+	# resolved classes, the order is the value of enum LineBreakClass
+	nclasses = split("AL OP CL CP QU GL NS EX SY IS PR PO NU HL ID IN HY BA BB B2 ZW CM WJ H2 H3 JL JV JT RI EB EM ZWJ CB", classes, " ");
+	for (i = 1; i <= nclasses; i++)
+		classid[classes[i]] = i - 1;
+	blockshift = 7;
+	blocksize = 2 ^ blockshift;
+	maxcp = 1114112; # 0x10FFFF + 1
+	nranges = 0;
+	nmissing = 0;
+}
+
+# version of the data file: the first line is the file name
+NR == 1 && /^# LineBreak/ {
+	version = $0;
+	sub(/^# /, "", version);
+}
+
+# default values for unlisted code points, the last matching line has priority
+/^# @missing:/ {
+	sub(/^# @missing:[ \t]*/, "");
+	split($0, f, ";");
+	gsub(/[ \t]/, "", f[1]);
+	gsub(/[ \t]/, "", f[2]);
+	n = split(f[1], r, "\\.\\.");
+	nmissing++;
+	ms[nmissing] = hex(r[1]);
+	me[nmissing] = hex(n > 1 ? r[2] : r[1]);
+	mc[nmissing] = classid[resolve(f[2])];
+	next;
+}
+
+/^[0-9A-Fa-f]/ {
+	gsub(/[ \t]/, "", $1);
+	gsub(/[ \t]/, "", $2);
+	n = split($1, r, "\\.\\.");
+	nranges++;
+	rs[nranges] = hex(r[1]);
+	re[nranges] = hex(n > 1 ? r[2] : r[1]);
+	rc[nranges] = classid[resolve($2)];
+}
+
+END {
+	# ranges are listed in ascending order in LineBreak.txt
+	ri = 1;
+	nblocks = 0;
+	for (cp = 0; cp < maxcp; cp += blocksize) {
+		key = "";
+		for (c = cp; c < cp + blocksize; c++) {
+			while (ri <= nranges && re[ri] < c)
+				ri++;
+			if (ri <= nranges && rs[ri] <= c) {
+				v = rc[ri];
+			} else {
+				v = classid["AL"];
+				for (m = nmissing; m > 0; m--) {
+					if (ms[m] <= c && c <= me[m]) {
+						v = mc[m];
+						break;
+					}
+				}
+			}
+			key = key (c > cp ? "," : "") v;
+		}
+		if (!(key in blockid)) {
+			blockid[key] = nblocks;
+			blockdata[nblocks] = key;
+			nblocks++;
+		}
+		stage1[cp / blocksize] = blockid[key];
+	}
+
+	printf("/* generated by linebreak.awk from the Unicode data file %s,\n",
+		version != "" ? version : "LineBreak.txt");
+	print "   do not edit this file. */";
+	print "";
+	print "enum LineBreakClass {";
+	for (i = 1; i <= nclasses; i++)
+		printf("\tLb%s%s\n", classes[i], i < nclasses ? "," : "");
+	print "};";
+	print "";
+	printf("#define LB_BLOCKSHIFT %d\n", blockshift);
+	printf("#define LB_BLOCKSIZE  %d\n", blocksize);
+	printf("#define LB_MAXCP      0x%X\n", maxcp - 1);
+	print "";
+	printf("static const %s lb_stage1[] = {", nblocks <= 256 ? "unsigned char" : "unsigned short");
+	for (i = 0; i < maxcp / blocksize; i++)
+		printf("%s%d,", (i % 16) ? " " : "\n\t", stage1[i]);
+	print "\n};";
+	print "";
+	print "static const unsigned char lb_stage2[][LB_BLOCKSIZE] = {";
+	for (i = 0; i < nblocks; i++) {
+		n = split(blockdata[i], vals, ",");
+		printf("{");
+		for (j = 1; j <= n; j++)
+			printf("%s%d,", (j % 32 == 1) ? "\n\t" : " ", vals[j]);
+		print "\n},";
+	}
+	print "};";
+	print "";
+	print "/* direct break opportunity between two classes: '_' break, '^' no break */";
+	printf("static const char lb_pairs[][%d] = {\n", nclasses + 1);
+	for (i = 1; i <= nclasses; i++) {
+		printf("\t\"");
+		for (j = 1; j <= nclasses; j++)
+			printf("%s", isbreak(classes[i], classes[j]) ? "_" : "^");
+		printf("\", /* %s */\n", classes[i]);
+	}
+	print "};";
+}
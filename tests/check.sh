@@ -0,0 +1,39 @@
+#!/bin/sh
+# regression tests: for each tests/NAME.html the output of webdump with the
+# options in tests/NAME.args, if it exists, must be equal to tests/NAME.out.
+# Each line of NAME.args is a run and the outputs are concatenated. The
+# options are shell words, "$prog" is webdump and "$tmpdir" is a directory
+# for output files, so a run can be a pipeline.
+#
+# usage: check.sh [webdump]
+
+prog="${1:-./webdump}"
+dir=$(dirname "$0")
+
+tmpdir=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmpdir"' EXIT
+tmp="$tmpdir/out"
+
+fail=0
+n=0
+for f in "$dir"/*.html; do
+	name="${f%.html}"
+	n=$((n + 1))
+	if [ -f "$name.args" ]; then
+		cat "$name.args"
+	else
+		echo
+	fi > "$tmpdir/args"
+	: > "$tmp"
+	ok=1
+	while IFS= read -r args; do
+		eval "\"\$prog\" $args" < "$f" >> "$tmp" 2>&1 || ok=0
+	done < "$tmpdir/args"
+	if [ "$ok" -eq 0 ] || ! cmp -s "$tmp" "$name.out"; then
+		echo "FAIL: ${name##*/}" >&2
+		diff "$name.out" "$tmp" >&2
+		fail=$((fail + 1))
+	fi
+done
+echo "$((n - fail))/$n tests passed"
+[ "$fail" -eq 0 ]
@@ -0,0 +1,40 @@
+#!/bin/sh
+# benchmark: deeply nested elements with data, closing them must not be
+# quadratic in the depth.
+#
+# usage: deepnest.sh [webdump...]
+# Each given program is timed, by default ./webdump. It fails if a run uses
+# more than $LIMIT seconds of CPU time (default: 5).
+
+LIMIT="${LIMIT:-5}"
+DEPTH="${DEPTH:-4000}"
+REPEAT="${REPEAT:-20}"
+
+[ $# -eq 0 ] && set -- ./webdump
+
+tmp=$(mktemp) || exit 1
+trap 'rm -f "$tmp"' EXIT
+
+awk -v depth="$DEPTH" -v repeat="$REPEAT" 'BEGIN {
+	for (r = 0; r < repeat; r++) {
+		for (i = 0; i < depth; i++)
+			printf("<em>x");
+		for (i = 0; i < depth; i++)
+			printf("</em>");
+	}
+	printf("\n");
+}' > "$tmp"
+
+status=0
+for prog in "$@"; do
+	echo "$prog: $REPEAT x $DEPTH nested <em> elements"
+	# the last line of times is the user and system time of the children
+	if ! t=$(ulimit -t "$LIMIT"; "$prog" < "$tmp" > /dev/null && times); then
+		echo "$prog: FAIL (exceeds $LIMIT seconds CPU time or error)" >&2
+		status=1
+		continue
+	fi
+	echo "$t" | awk 'END { print "user " $1 " system " $2 }'
+
+done
+exit $status
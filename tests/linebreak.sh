@@ -0,0 +1,29 @@
+#!/bin/sh
+# check the line-break tables generated by linebreak.awk: the sample of the
+# Unicode data in tests/LineBreak-sample.txt must give tests/linebreak-sample.h
+# and, if it exists, LineBreak.txt must give linebreak.h.
+#
+# usage: linebreak.sh [LineBreak.txt]
+
+data="${1:-LineBreak.txt}"
+dir=$(dirname "$0")
+
+tmp=$(mktemp) || exit 1
+trap 'rm -f "$tmp"' EXIT
+
+fail=0
+awk -f "$dir/../linebreak.awk" < "$dir/LineBreak-sample.txt" > "$tmp"
+if ! cmp -s "$tmp" "$dir/linebreak-sample.h"; then
+	echo "FAIL: linebreak.awk: $dir/LineBreak-sample.txt" >&2
+	fail=1
+fi
+if [ -f "$data" ]; then
+	awk -f "$dir/../linebreak.awk" < "$data" > "$tmp"
+	if ! cmp -s "$tmp" "$dir/../linebreak.h"; then
+		echo "FAIL: linebreak.h is not generated from $data" >&2
+		fail=1
+	fi
+else
+	echo "linebreak.sh: $data not found, linebreak.h is not checked" >&2
+fi
+[ "$fail" -eq 0 ]
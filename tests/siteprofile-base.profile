@@ -0,0 +1,3 @@
+example.org -s main
+example.org -u .ad
+example.org -n 1
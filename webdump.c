@@ -1,16 +1,23 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "arg.h"
 char *argv0;
 
-#include "tree.h"
+#include "linebreak.h"
 #include "xml.h"
 
 static XMLParser parser;
@@ -33,26 +40,63 @@ size_t strlcpy(char *, const char *, size_t);
 
 #define LEN(x) (sizeof(x) / sizeof(x[0]))
 
-/* URI */
+/* URI component: a view of length len at offset off in the source string */
+struct urispan {
+	size_t off;
+	size_t len;
+};
+
+/* URI, the components are views into the parsed string, which must stay
+   valid while the URI is used. A component is unset when its length is 0 */
 struct uri {
-	char proto[48];     /* scheme including ":" or "://" */
-	char userinfo[256]; /* username [:password] */
-	char host[256];
-	char port[6];       /* numeric port */
-	char path[1024];
-	char query[1024];
-	char fragment[1024];
+	const char *s;            /* parsed string */
+	struct urispan proto;     /* scheme including ":" or "://" */
+	struct urispan userinfo;  /* username [:password] */
+	struct urispan host;
+	struct urispan port;      /* numeric port */
+	struct urispan path;
+	struct urispan query;
+	struct urispan fragment;
 };
 
+#define MAX_NODE_DEPTH 4096 /* default maximum node depth */
+#ifndef CACHE_MAXSIZE
+#define CACHE_MAXSIZE (64 * 1024 * 1024) /* maximum size of the cache directory */
+#endif
+
 /* options */
+/* profile of the rendering options (-w): with several profiles the HTML is
+   parsed once and the output of each is written to its own file (-o) */
+struct profile {
+	char *name; /* as specified, used for the file name */
+	int termwidth;
+	int allowansi;
+	int allowlinewrap;
+	FILE *fp;
+};
+static struct profile *profiles;
+static size_t nprofiles;
+
 static int allowansi     = 0;  /* (-a) allow ANSI escape codes */
 static int uniqrefs      = 1;  /* (-d) number unique references */
 static int showrefinline = 1;  /* (-i) show link reference number inline */
 static int showurlinline = 0;  /* (-I) show full link reference inline */
 static int showrefbottom = 1;  /* (-l) show link references at the bottom */
 static int allowlinewrap = 1;  /* (-r) line-wrapping */
+static int maxnodedepth  = MAX_NODE_DEPTH; /* (-m) maximum node depth */
 static int termwidth     = 72; /* (-w) terminal width */
 static int resources     = 0;  /* (-x) write resources line-by-line to fd 3? */
+static int layoutmode    = 0;  /* (-L) write the layout format */
+static int reflowmode    = 0;  /* (-R) render the layout format */
+static int tokenmode     = 0;  /* (-t) write the token stream */
+static int replaymode    = 0;  /* (-T) render the token stream */
+static char *cachedir;         /* (-c) cache directory */
+static char *outprefix;        /* (-o) prefix of the output files per profile */
+static char *widtharg;         /* (-w) terminal width or profiles */
+static char *basehrefarg;      /* (-b) base URL argument */
+static char *selshowarg, *selhidearg; /* (-s, -u) selector arguments */
+static char *selhidefile; /* (-U) file with selectors to hide */
+static char *siteprofilefile; /* (-p) file with per-site profiles */
 
 enum DisplayType {
 	DisplayUnknown     = 0,
@@ -122,45 +166,143 @@ struct tag {
 };
 
 struct node {
-	char tagname[256];
-	struct tag tag;
+	const struct tag *tag; /* tag information */
+	enum DisplayType displaytype; /* display type, can be changed per node */
 	size_t nchildren; /* child node count */
 	size_t visnchildren; /* child node count which are visible */
-	/* attributes */
-	char id[256];
-	char classnames[1024];
 	int indent; /* indent per node, for formatting */
 	int hasdata; /* tag contains some data, for formatting */
+	/* state of the parent nodes, set when the node is added */
+	int parentindent; /* sum of the indentation of the parent nodes */
+	int parenttypes; /* display types of the parent nodes combined */
+	int listdepth; /* depth of nearest list node (or itself) or -1 */
+	int listitemdepth; /* depth of nearest list item node (or itself) or -1 */
+	int containerdepth; /* depth of nearest list or table node (or itself) or -1 */
+	int tabledepth; /* depth of nearest table node (or itself) or -1 */
+	int tablerowdepth; /* depth of nearest table row node (or itself) or -1 */
+	int selectdepth; /* depth of nearest select node (or itself) or -1 */
+	int dldepth; /* depth of nearest dl node (or itself) or -1 */
+	int prevsame; /* depth of previous open node with the same tag id or 0 */
+	int ndata; /* count of parent nodes which have data set */
+	int nlistitemdata; /* count of parent list item nodes which have data set */
+};
+
+/* strings of a node: offsets in the string pool of the node tree. These are
+   not used for formatting so they are stored separately */
+struct nodestrings {
+	size_t tagname; /* tag name, only for tags not in the tags table */
+	/* attributes, only set when selectors are used */
+	size_t id;
+	/* all attributes as "name\0value\0" pairs, only set when selectors
+	   match on attributes */
+	size_t attrs;
+	size_t attrslen;
+	size_t end; /* end offset of the strings of this node */
+};
+
+/* Bloom filter of the keys of a node and its parents: tag name, id and
+   classes */
+#define BLOOM_WORDS 4
+struct bloom {
+	uint64_t w[BLOOM_WORDS];
+};
+
+enum KeyType { KeyTag = 1, KeyId, KeyClass };
+
+/* classes of a node as a set of hashes, only set when selectors are used.
+   The buffers are kept per node depth */
+struct nodeclasses {
+	uint64_t *hashes; /* keyhash() of each class */
+	size_t len;
+	size_t cap;
+};
+
+/* attribute of a selector node: [name], [name=value] or [name^=value] */
+struct selectorattr {
+	const char *name;
+	int op; /* 0: is set, '=': equal, '^': starts with */
+	const char *value;
+	size_t valuelen;
 };
 
+/* strings are "" if not set */
 struct selectornode {
-	char tagname[256];
+	const char *tagname;
 	long index; /* index of node to match on: -1 if not matching on index */
+	/* :nth-child(an+b) and :first-child: the position of the node in its
+	   parent is an+b for some n >= 0 */
+	int hasnth;
+	long ntha, nthb;
+	int ischild; /* combinator ">": the node is a child of the previous */
 	/* attributes */
-	char id[256];
-	char classnames[1024];
+	const char *id;
+	uint64_t *classes; /* keyhash() of each class, all must match */
+	size_t nclasses;
+	struct selectorattr *attrs;
+	size_t nattrs;
 };
 
+#define SELECTOR_MAXNODES 64 /* nodes of a selector, a bit each in the state */
+
 struct selector {
-	const char *text;
-	struct selectornode nodes[32];
+	struct selectornode *nodes;
 	int depth;
+	int haschild; /* has a child combinator */
+	uint64_t childmask; /* bit k: node k is a child of node k - 1 */
+	struct bloom bloom; /* keys of the nodes except the last */
+	/* key of the last node in the index: id, class or tag name */
+	int haskey;
+	uint64_t keyhash;
+	struct selector *next; /* next selector in the same index bucket */
+};
+
+/* match state of a selector for a node: bit k is set when the nodes of the
+   selector up to k matched with node k on the node (at) or on the node or a
+   parent (any) */
+struct selectorstate {
+	uint64_t at, any;
 };
 
+/* lists of at least this many selectors are indexed by key, see
+   indexselectors() */
+#define SELECTORS_INDEXMIN 32
+
 /* list of selectors */
 struct selectors {
 	struct selector **selectors;
 	size_t count;
+	/* selectors indexed by the key of their last node */
+	struct selector **table;
+	size_t tablesize; /* power of two */
+	struct selector *other; /* last node has no key */
+	/* when not indexed: the match state per node depth, for each selector */
+	struct selectorstate *states;
+	size_t nstates; /* selectors per node depth in states */
+	char *matched; /* per node depth: a selector matched the node or a parent */
+	size_t capnodes;
 };
 
-/* RB tree of link references */
+/* open-addressing hash table of values keyed by bytes, see hashget() */
+struct hashentry {
+	const char *key; /* NULL if the entry is empty */
+	size_t len;
+	uint64_t hash;
+	void *value;
+};
+
+struct hashtable {
+	struct hashentry *entries;
+	size_t len, cap; /* used / capacity: power of two */
+};
+
+/* link references */
 struct linkref {
-	char *type;
+	const char *type; /* tag name or "link", not allocated */
 	enum TagId tagid;
 	char *url;
+	size_t urllen;
 	int ishidden;
 	size_t linknr;
-	RB_ENTRY(linkref) entry;
 };
 
 /* link references and hidden link references */
@@ -169,15 +311,23 @@ static size_t nvisrefs, ncapvisrefs; /* visible link count / capacity */
 static struct linkref **hiddenrefs;
 static size_t nhiddenrefs, ncaphiddenrefs; /* hidden link count / capacity */
 
-/* compare link by URL for link references RB-tree */
-static int
-linkrefcmp(struct linkref *r1, struct linkref *r2)
-{
-	return strcmp(r1->url, r2->url);
-}
+/* link references by URL, for deduplication */
+static struct hashtable linkreftable;
 
-RB_HEAD(linkreftree, linkref) linkrefhead = RB_INITIALIZER(&linkrefhead);
-RB_GENERATE(linkreftree, linkref, entry, linkrefcmp)
+/* memoized absolute URLs, keyed by the URL as written in the document. The
+   base href cannot change once it is set, so the entries stay valid */
+struct urlmemo {
+	char *url;
+	char *absurl; /* absolute URL, or url if it cannot be made absolute */
+};
+
+static struct hashtable urlmemotable;
+
+/* bump allocator for link references and their URLs, these live until exit */
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 16
+static char *arenap;
+static size_t arenaleft;
 
 static const char *str_section_symbol = "§";
 static const char *str_bullet_item = "• ";
@@ -188,6 +338,7 @@ static const char *str_radio_checked = "✓";
 /* base href, to make URLs absolute */
 static char basehrefdoc[4096]; /* buffer for base href in document, if any */
 static int basehrefset; /* base href set and can be used? */
+static char *basehrefsrc; /* copy of the base href in the document */
 static struct uri base; /* parsed current base href */
 
 /* buffers for some attributes of the current tag */
@@ -195,6 +346,7 @@ static String attr_alt; /* alt attribute */
 static String attr_checked; /* checked attribute */
 static String attr_class; /* class attribute */
 static int attr_class_set; /* class attribute is set already */
+static String attr_all; /* all attributes, only when selectors use them */
 static String attr_data; /* data attribute */
 static String attr_href; /* href attribute */
 static String attr_id; /* id attribute */
@@ -230,22 +382,72 @@ static char rbuf[1024];
 static int rbuflen;
 static int rnbufcells; /* pending cell count to add */
 
-#define MAX_NODE_DEPTH 4096 /* absolute maximum node depth */
+/* state for line-break opportunities between non-ASCII codepoints (UAX #14) */
+static long lbcp; /* codepoint which is currently decoded */
+static long lbprevcp; /* previous codepoint */
+static int lbcont; /* remaining UTF-8 continuation bytes of codepoint */
+static int lbstart; /* offset in rbuf where the current codepoint starts */
+static int lbprev = -1; /* line-break class of previous codepoint or -1 */
+
 static struct node *nodes; /* node tree (one per level is remembered) */
 static String *nodes_links; /* keep track of links per node */
+static struct nodestrings *nodes_strings; /* strings per node */
+static struct bloom *nodes_bloom; /* keys of the node and its parents */
+static struct nodeclasses *nodes_classes; /* classes per node */
+static String nodes_strpool; /* string pool of the nodes, used like a stack */
 static size_t ncapnodes; /* current allocated node capacity */
 static int curnode; /* current node depth */
+/* nodes below this depth have data: set when a node with data ends */
+static int datadepth;
 
 /* reader / selector mode (-s) */
 static int reader_mode;
 /* flag if the tags and their children should be ignored in the current context */
 static int reader_ignore;
+static int reader_maxmatches; /* (-n) stop after this many matches, 0 for all */
+static int reader_nmatches; /* count of matches which ended */
+static int reader_done; /* stop reading the input */
 
 static enum MarkupType curmarkup; /* current markup state (bold, underline, etc) */
 static int linewrap; /* allow linewrap in this context */
 
+/* render functions specialized for the options, selected at startup */
+struct renderer {
+	void (*hputchar)(int);
+	void (*printtext)(const char *, size_t);
+	void (*setmarkup)(int);
+};
+static const struct renderer *render;
+
 /* selector to match (for -s and -u) */
 static struct selectors *sel_hide, *sel_show;
+static int selattrs; /* selectors match on attributes: keep them per node */
+
+/* field of the extraction mode (-e name=selector[@attribute]): the text or
+   attribute value of the first matching element */
+struct field {
+	const char *arg;
+	char *name;
+	struct selectors *sels;
+	char *attr; /* attribute to extract or NULL for the text */
+	String value;
+	int active; /* text of the matched node is extracted */
+	int depth; /* depth of the matched node */
+	int done; /* the value is set */
+};
+static struct field *fields;
+static size_t nfields;
+static size_t nfieldsdone;
+static int jsonfields; /* (-j) write the fields as NDJSON instead of TSV */
+
+/* per-site profile (-p file): options for a host and its subdomains */
+struct siteprofile {
+	char *host;
+	String show; /* selectors (-s) */
+	String hide; /* selectors (-u) */
+	int maxmatches; /* (-n) */
+};
+static struct hashtable siteprofiles; /* by host */
 
 /* tags table: needs to be sorted like tagcmp(), alphabetically */
 
@@ -344,6 +546,15 @@ static struct tag tags[] = {
 { "xmp",        TagXmp,        DisplayPre,                       0,               0,               0, 0, 1, 1, DEFAULT_TABSTOP }
 };
 
+/* depth of the nearest open node per tag id or 0 if there is none. The open
+   nodes with the same tag id are linked by their prevsame field. Tags which
+   are not in the tags table use the tag id 0 */
+static int opentags[LEN(tags) + 1];
+
+/* tag information for the root node and for tags not in the tags table */
+static const struct tag roottag = { .name = "" };
+static const struct tag unknowntag = { .name = "", .displaytype = DisplayInline };
+
 /* hint for compilers and static analyzers that a function exits */
 #ifndef __dead
 #define __dead
@@ -415,6 +626,13 @@ getnext_ignore(void)
 	return ' '; /* pretend there is just SPACEs */
 }
 
+/* read nothing more, used to stop parsing */
+static int
+getnext_eof(void)
+{
+	return EOF;
+}
+
 /* Clear string only; don't free, prevents unnecessary reallocation. */
 static void
 string_clear(String *s)
@@ -489,6 +707,72 @@ ecalloc(size_t nmemb, size_t size)
 	return p;
 }
 
+/* 64-bit FNV-1a hash */
+static uint64_t
+hash64(uint64_t h, const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static struct hashentry *
+hashlookup(struct hashentry *entries, size_t cap, uint64_t h, const char *key,
+	size_t len)
+{
+	size_t i;
+
+	for (i = h & (cap - 1); entries[i].key; i = (i + 1) & (cap - 1)) {
+		if (entries[i].hash == h && entries[i].len == len &&
+		    !memcmp(entries[i].key, key, len))
+			break;
+	}
+	return &entries[i];
+}
+
+/* value of the key with hash h in the table or NULL */
+static void *
+hashget(struct hashtable *t, uint64_t h, const char *key, size_t len)
+{
+	if (!t->cap)
+		return NULL;
+	return hashlookup(t->entries, t->cap, h, key, len)->value;
+}
+
+/* add a value for a key which is not in the table yet, the key is not copied */
+static void
+hashput(struct hashtable *t, uint64_t h, const char *key, size_t len,
+	void *value)
+{
+	struct hashentry *entries, *e;
+	size_t i, cap;
+
+	/* grow the hash table when it is half full */
+	if (t->len * 2 >= t->cap) {
+		cap = t->cap ? t->cap * 2 : 64;
+		entries = ecalloc(cap, sizeof(*entries));
+		for (i = 0; i < t->cap; i++) {
+			e = &t->entries[i];
+			if (e->key)
+				*hashlookup(entries, cap, e->hash, e->key, e->len) = *e;
+		}
+		free(t->entries);
+		t->entries = entries;
+		t->cap = cap;
+	}
+
+	e = hashlookup(t->entries, t->cap, h, key, len);
+	e->key = key;
+	e->len = len;
+	e->hash = h;
+	e->value = value;
+	t->len++;
+}
+
 /* check if string has a non-empty scheme / protocol part */
 static int
 uri_hasscheme(const char *s)
@@ -502,16 +786,22 @@ uri_hasscheme(const char *s)
 	return (*p == ':' && p != s);
 }
 
+static void
+urispanset(struct urispan *sp, const char *s, const char *p, size_t len)
+{
+	sp->off = p - s;
+	sp->len = len;
+}
+
 static int
 uri_parse(const char *s, struct uri *u)
 {
 	const char *p = s;
-	char *endptr;
-	size_t i;
+	size_t i, j;
 	long l;
 
-	u->proto[0] = u->userinfo[0] = u->host[0] = u->port[0] = '\0';
-	u->path[0] = u->query[0] = u->fragment[0] = '\0';
+	memset(u, 0, sizeof(*u));
+	u->s = s;
 
 	/* protocol-relative */
 	if (*p == '/' && *(p + 1) == '/') {
@@ -530,10 +820,7 @@ uri_parse(const char *s, struct uri *u)
 		else
 			p++; /* skip ":" */
 
-		if ((size_t)(p - s) >= sizeof(u->proto))
-			return -1; /* protocol too long */
-		memcpy(u->proto, s, p - s);
-		u->proto[p - s] = '\0';
+		urispanset(&u->proto, s, s, p - s);
 
 		if (*(p - 1) != '/')
 			goto parsepath;
@@ -546,16 +833,13 @@ parseauth:
 	/* userinfo (username:password) */
 	i = strcspn(p, "@/?#");
 	if (p[i] == '@') {
-		if (i >= sizeof(u->userinfo))
-			return -1; /* userinfo too long */
-		memcpy(u->userinfo, p, i);
-		u->userinfo[i] = '\0';
+		urispanset(&u->userinfo, s, p, i);
 		p += i + 1;
 	}
 
 	/* IPv6 address */
 	if (*p == '[') {
-		/* bracket not found, host too short or too long */
+		/* bracket not found or host too short */
 		i = strcspn(p, "]");
 		if (p[i] != ']' || i < 3)
 			return -1;
@@ -564,130 +848,126 @@ parseauth:
 		/* domain / host part, skip until port, path or end. */
 		i = strcspn(p, ":/?#");
 	}
-	if (i >= sizeof(u->host))
-		return -1; /* host too long */
-	memcpy(u->host, p, i);
-	u->host[i] = '\0';
+	urispanset(&u->host, s, p, i);
 	p += i;
 
 	/* port */
 	if (*p == ':') {
 		p++;
-		if ((i = strcspn(p, "/?#")) >= sizeof(u->port))
-			return -1; /* port too long */
-		memcpy(u->port, p, i);
-		u->port[i] = '\0';
+		i = strcspn(p, "/?#");
 		/* check for valid port: range 1 - 65535, may be empty */
-		errno = 0;
-		l = strtol(u->port, &endptr, 10);
-		if (i && (errno || *endptr || l <= 0 || l > 65535))
+		for (j = 0, l = 0; j < i; j++) {
+			if (!ISDIGIT((unsigned char)p[j]))
+				return -1;
+			if ((l = l * 10 + (p[j] - '0')) > 65535)
+				return -1;
+		}
+		if (i && l <= 0)
 			return -1;
+		urispanset(&u->port, s, p, i);
 		p += i;
 	}
 
 parsepath:
 	/* path */
-	if ((i = strcspn(p, "?#")) >= sizeof(u->path))
-		return -1; /* path too long */
-	memcpy(u->path, p, i);
-	u->path[i] = '\0';
+	i = strcspn(p, "?#");
+	urispanset(&u->path, s, p, i);
 	p += i;
 
 	/* query */
 	if (*p == '?') {
 		p++;
-		if ((i = strcspn(p, "#")) >= sizeof(u->query))
-			return -1; /* query too long */
-		memcpy(u->query, p, i);
-		u->query[i] = '\0';
+		i = strcspn(p, "#");
+		urispanset(&u->query, s, p, i);
 		p += i;
 	}
 
 	/* fragment */
 	if (*p == '#') {
 		p++;
-		if ((i = strlen(p)) >= sizeof(u->fragment))
-			return -1; /* fragment too long */
-		memcpy(u->fragment, p, i);
-		u->fragment[i] = '\0';
+		urispanset(&u->fragment, s, p, strlen(p));
 	}
 
 	return 0;
 }
 
-/* Transform and try to make the URI `u` absolute using base URI `b` into `a`.
+/* append URI component */
+static void
+urispanappend(String *out, const struct uri *u, const struct urispan *sp)
+{
+	if (sp->len)
+		string_append(out, u->s + sp->off, sp->len);
+}
+
+/* Resolve the URI `u` against the base URI `b` and append the result to `out`.
    Follows some of the logic from "RFC 3986 - 5.2.2. Transform References".
-   Returns 0 on success, -1 on error or truncation. */
+   Returns 0 on success or -1 if the result would not be absolute. */
 static int
-uri_makeabs(struct uri *a, struct uri *u, struct uri *b)
+uri_resolve(String *out, const struct uri *u, const struct uri *b)
 {
-	char *p;
-	int c;
+	const struct uri *auth;
+	const char *bpath;
+	size_t i;
 
-	strlcpy(a->fragment, u->fragment, sizeof(a->fragment));
+	if (!u->proto.len && !b->proto.len)
+		return -1;
 
-	if (u->proto[0] || u->host[0]) {
-		strlcpy(a->proto, u->proto[0] ? u->proto : b->proto, sizeof(a->proto));
-		strlcpy(a->host, u->host, sizeof(a->host));
-		strlcpy(a->userinfo, u->userinfo, sizeof(a->userinfo));
-		strlcpy(a->host, u->host, sizeof(a->host));
-		strlcpy(a->port, u->port, sizeof(a->port));
-		strlcpy(a->path, u->path, sizeof(a->path));
-		strlcpy(a->query, u->query, sizeof(a->query));
-		return 0;
-	}
+	/* authority part: from the reference if it has one, else from the base */
+	auth = (u->proto.len || u->host.len) ? u : b;
 
-	strlcpy(a->proto, b->proto, sizeof(a->proto));
-	strlcpy(a->host, b->host, sizeof(a->host));
-	strlcpy(a->userinfo, b->userinfo, sizeof(a->userinfo));
-	strlcpy(a->host, b->host, sizeof(a->host));
-	strlcpy(a->port, b->port, sizeof(a->port));
+	if (u->proto.len)
+		urispanappend(out, u, &u->proto);
+	else
+		urispanappend(out, b, &b->proto);
+	if (auth->userinfo.len) {
+		urispanappend(out, auth, &auth->userinfo);
+		string_append(out, "@", 1);
+	}
+	urispanappend(out, auth, &auth->host);
+	if (auth->port.len) {
+		string_append(out, ":", 1);
+		urispanappend(out, auth, &auth->port);
+	}
 
-	if (!u->path[0]) {
-		strlcpy(a->path, b->path, sizeof(a->path));
-	} else if (u->path[0] == '/') {
-		strlcpy(a->path, u->path, sizeof(a->path));
+	if (auth == u) {
+		if (u->host.len && u->path.len && u->s[u->path.off] != '/')
+			string_append(out, "/", 1);
+		urispanappend(out, u, &u->path);
+	} else if (!u->path.len) {
+		if (b->host.len && b->path.len && b->s[b->path.off] != '/')
+			string_append(out, "/", 1);
+		urispanappend(out, b, &b->path);
+	} else if (u->s[u->path.off] == '/') {
+		urispanappend(out, u, &u->path);
 	} else {
-		a->path[0] = (b->host[0] && b->path[0] != '/') ? '/' : '\0';
-		a->path[1] = '\0';
+		/* merge: the base path up to and including the last "/" */
+		bpath = b->s + b->path.off;
+		for (i = b->path.len; i > 0 && bpath[i - 1] != '/'; i--)
+			;
+		if (b->host.len && (!b->path.len || bpath[0] != '/'))
+			string_append(out, "/", 1);
+		if (i)
+			string_append(out, bpath, i);
+		urispanappend(out, u, &u->path);
+	}
 
-		if ((p = strrchr(b->path, '/'))) {
-			c = *(++p);
-			*p = '\0'; /* temporary NUL-terminate */
-			if (strlcat(a->path, b->path, sizeof(a->path)) >= sizeof(a->path))
-				return -1;
-			*p = c; /* restore */
+	if (auth == u || u->path.len || u->query.len) {
+		if (u->query.len) {
+			string_append(out, "?", 1);
+			urispanappend(out, u, &u->query);
 		}
-		if (strlcat(a->path, u->path, sizeof(a->path)) >= sizeof(a->path))
-			return -1;
+	} else if (b->query.len) {
+		string_append(out, "?", 1);
+		urispanappend(out, b, &b->query);
+	}
+	if (u->fragment.len) {
+		string_append(out, "#", 1);
+		urispanappend(out, u, &u->fragment);
 	}
-
-	if (u->path[0] || u->query[0])
-		strlcpy(a->query, u->query, sizeof(a->query));
-	else
-		strlcpy(a->query, b->query, sizeof(a->query));
 
 	return 0;
 }
 
-static int
-uri_format(char *buf, size_t bufsiz, struct uri *u)
-{
-	return snprintf(buf, bufsiz, "%s%s%s%s%s%s%s%s%s%s%s%s",
-		u->proto,
-		u->userinfo[0] ? u->userinfo : "",
-		u->userinfo[0] ? "@" : "",
-		u->host,
-		u->port[0] ? ":" : "",
-		u->port,
-		u->host[0] && u->path[0] && u->path[0] != '/' ? "/" : "",
-		u->path,
-		u->query[0] ? "?" : "",
-		u->query,
-		u->fragment[0] ? "#" : "",
-		u->fragment);
-}
-
 /* compare tag name (case-insensitive) */
 static int
 tagcmp(const char *s1, const char *s2)
@@ -705,20 +985,79 @@ attrcmp(const char *s1, const char *s2)
 static void
 rindent(void)
 {
-	int i, total;
+	static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	static const char spaces[] = "        ";
+	int n, total;
 
 	total = indent + defaultindent;
 	if (total < 0)
 		total = 0;
-	for (i = 0; i < total / DEFAULT_TABSTOP; i++)
-		putchar('\t');
-	for (i = 0; i < total % DEFAULT_TABSTOP; i++)
-		putchar(' ');
+	for (n = total / DEFAULT_TABSTOP; n > 0; n -= sizeof(tabs) - 1)
+		fwrite(tabs, 1, n < (int)sizeof(tabs) - 1 ? n : (int)sizeof(tabs) - 1, stdout);
+	fwrite(spaces, 1, total % DEFAULT_TABSTOP, stdout);
 
 	nbytesline += total;
 	ncells += total;
 }
 
+/* SGR codes to set and reset each markup type */
+static const struct {
+	enum MarkupType markuptype;
+	const char *set;
+	const char *reset;
+} sgrcodes[] = {
+	{ MarkupBold,      "1", "22" }, /* reset bold or faint */
+	{ MarkupItalic,    "3", "23" },
+	{ MarkupUnderline, "4", "24" },
+	{ MarkupBlink,     "5", "25" },
+	{ MarkupReverse,   "7", "27" },
+	{ MarkupStrike,    "9", "29" }
+};
+
+/* precomputed escape sequence for each markup transition: from, to */
+#define MARKUP_MAX (1 << LEN(sgrcodes))
+static char sgr[MARKUP_MAX][MARKUP_MAX][24];
+static size_t sgrlen[MARKUP_MAX][MARKUP_MAX];
+
+/* precompute the minimal escape sequences for all markup transitions, for
+   example: "\033[1;4m" to set bold and underline */
+static void
+initsgr(void)
+{
+	char *s;
+	size_t i, n;
+	int from, to, pass;
+
+	for (from = 0; from < MARKUP_MAX; from++) {
+		for (to = 0; to < MARKUP_MAX; to++) {
+			s = sgr[from][to];
+			if (from == to) {
+				n = 0;
+			} else if (!to) {
+				n = strlcpy(s, "\033[0m", sizeof(sgr[0][0])); /* reset all attributes */
+			} else {
+				n = strlcpy(s, "\033[", sizeof(sgr[0][0]));
+				/* first set, then reset the changed markup types */
+				for (pass = 0; pass < 2; pass++) {
+					for (i = 0; i < LEN(sgrcodes); i++) {
+						if (!(from & sgrcodes[i].markuptype) == !(to & sgrcodes[i].markuptype))
+							continue;
+						if (!pass && (to & sgrcodes[i].markuptype))
+							strlcat(s, sgrcodes[i].set, sizeof(sgr[0][0]));
+						else if (pass && (from & sgrcodes[i].markuptype))
+							strlcat(s, sgrcodes[i].reset, sizeof(sgr[0][0]));
+						else
+							continue;
+						n = strlcat(s, ";", sizeof(sgr[0][0]));
+					}
+				}
+				s[n - 1] = 'm'; /* replace the last ";" */
+			}
+			sgrlen[from][to] = n;
+		}
+	}
+}
+
 static void
 emitmarkup(int markuptype)
 {
@@ -727,59 +1066,109 @@ emitmarkup(int markuptype)
 
 	if (!markuptype)
 		fputs("\033[0m", stdout); /* reset all attributes */
+	else
+		fwrite(sgr[0][markuptype], 1, sgrlen[0][markuptype], stdout);
+}
+
+/* layout format (-L): the output operations before word-wrapping, so it can
+   be rendered at any width with -R without parsing the HTML again. Each
+   record is a line: I<n> indentation, M<n> markup, T<text> text, L newline
+   and F flush of the word-wrapping, N newline and R ruler. The records
+   P<len> preformatted text and X<len> raw text are followed by the data. */
+static FILE *layoutfp;
+static String layouttext; /* text run which is not written yet */
+static int layoutindent = INT_MIN, layoutdirty;
+
+static void
+layoutflushtext(void)
+{
+	if (!layouttext.len)
+		return;
+	fputc('T', layoutfp);
+	fwrite(layouttext.data, 1, layouttext.len, layoutfp);
+	fputc('\n', layoutfp);
+	string_clear(&layouttext);
+}
+
+static void
+layoutrecord(int type, const char *s, size_t len)
+{
+	if (indent != layoutindent) {
+		layoutflushtext();
+		fprintf(layoutfp, "I%d\n", indent);
+		layoutindent = indent;
+	}
+
+	switch (type) {
+	case 'T':
+		string_append(&layouttext, s, len);
+		layoutdirty = 1;
+		return;
+	case 'F':
+		/* only needed when there can be data in the word buffer */
+		if (!layoutdirty)
+			return;
+		layoutdirty = 0;
+		break;
+	case 'L':
+		layoutdirty = 0; /* the word buffer is flushed */
+		break;
+	case 'M':
+	case 'R':
+		layoutdirty = 1;
+		break;
+	}
+
+	layoutflushtext();
+	fputc(type, layoutfp);
+	if (type == 'P' || type == 'X') {
+		fprintf(layoutfp, "%zu\n", len);
+		fwrite(s, 1, len, layoutfp);
+	} else {
+		if (s)
+			fwrite(s, 1, len, layoutfp);
+		fputc('\n', layoutfp);
+	}
+}
 
-	/* set */
-	if (markuptype & MarkupBold)
-		fputs("\033[1m", stdout);
-	if (markuptype & MarkupItalic)
-		fputs("\033[3m", stdout);
-	if (markuptype & MarkupUnderline)
-		fputs("\033[4m", stdout);
-	if (markuptype & MarkupBlink)
-		fputs("\033[5m", stdout);
-	if (markuptype & MarkupReverse)
-		fputs("\033[7m", stdout);
-	if (markuptype & MarkupStrike)
-		fputs("\033[9m", stdout);
+/* start of a line: indent and emit the markup code again per line, needed
+   for GNU/less -R */
+static void
+startline(void)
+{
+	if (curmarkup)
+		emitmarkup(0);
+	rindent();
+	if (curmarkup)
+		emitmarkup(curmarkup);
 }
 
 /* flush remaining buffer (containing a word): used for word-wrap handling */
 static void
 hflush(void)
 {
-	int i;
+	if (layoutfp)
+		layoutrecord('F', NULL, 0);
 
 	if (!rbuflen)
 		return;
 
-	if (!nbytesline) {
-		if (curmarkup)
-			emitmarkup(0);
-		rindent();
-		/* emit code again per line, needed for GNU/less -R */
-		if (curmarkup)
-			emitmarkup(curmarkup);
-	}
+	if (!nbytesline)
+		startline();
 
-	for (i = 0; i < rbuflen; i++)
-		putchar(rbuf[i]);
+	fwrite(rbuf, 1, rbuflen, stdout);
 
 	nbytesline += rbuflen;
 	ncells += rnbufcells;
 	rbuflen = 0;
 	rnbufcells = 0;
+	lbstart = 0;
 }
 
-static void
-printansi(const char *s)
+static inline void
+printansi_impl(const char *s, size_t len, int wrap)
 {
-	size_t len;
-
-	if (!allowansi)
-		return;
-
-	if (linewrap) {
-		len = strlen(s);
+	if (wrap) {
 		if (rbuflen + len + 1 >= sizeof(rbuf))
 			hflush();
 		if (rbuflen + len + 1 < sizeof(rbuf)) {
@@ -788,57 +1177,43 @@ printansi(const char *s)
 			/* NOTE: nbytesline and ncells are not counted for markup */
 		}
 	} else {
-		fputs(s, stdout);
+		fwrite(s, 1, len, stdout);
 	}
 }
 
-static void
-setmarkup(int markuptype)
+static inline void
+setmarkup_impl(int markuptype, int wrap, int ansi, int layout)
 {
-	if (!allowansi)
+	char buf[16];
+
+	if (layout) {
+		/* markup is always recorded, -a is used when rendering */
+		if (curmarkup != markuptype) {
+			snprintf(buf, sizeof(buf), "%d", markuptype);
+			layoutrecord('M', buf, strlen(buf));
+			curmarkup = markuptype;
+		}
 		return;
+	}
 
-	/* need change? */
-	if (curmarkup == markuptype)
+	if (!ansi)
 		return;
 
-	if (!markuptype) {
-		printansi("\033[0m"); /* reset all attributes */
-		curmarkup = markuptype;
+	/* need change? */
+	if (curmarkup == markuptype)
 		return;
-	}
 
-	/* set */
-	if (!(curmarkup & MarkupBold) && (markuptype & MarkupBold))
-		printansi("\033[1m");
-	if (!(curmarkup & MarkupItalic) && (markuptype & MarkupItalic))
-		printansi("\033[3m");
-	if (!(curmarkup & MarkupUnderline) && (markuptype & MarkupUnderline))
-		printansi("\033[4m");
-	if (!(curmarkup & MarkupBlink) && (markuptype & MarkupBlink))
-		printansi("\033[5m");
-	if (!(curmarkup & MarkupReverse) && (markuptype & MarkupReverse))
-		printansi("\033[7m");
-	if (!(curmarkup & MarkupStrike) && (markuptype & MarkupStrike))
-		printansi("\033[9m");
-
-	/* unset */
-	if ((curmarkup & MarkupBold) && !(markuptype & MarkupBold))
-		printansi("\033[22m"); /* reset bold or faint */
-	if ((curmarkup & MarkupItalic) && !(markuptype & MarkupItalic))
-		printansi("\033[23m"); /* reset italic */
-	if ((curmarkup & MarkupUnderline) && !(markuptype & MarkupUnderline))
-		printansi("\033[24m"); /* reset underline */
-	if ((curmarkup & MarkupBlink) && !(markuptype & MarkupBlink))
-		printansi("\033[25m"); /* reset blink */
-	if ((curmarkup & MarkupReverse) && !(markuptype & MarkupReverse))
-		printansi("\033[27m"); /* reset reverse */
-	if ((curmarkup & MarkupStrike) && !(markuptype & MarkupStrike))
-		printansi("\033[29m"); /* reset strike */
+	printansi_impl(sgr[curmarkup][markuptype], sgrlen[curmarkup][markuptype], wrap);
 
 	curmarkup = markuptype;
 }
 
+static void
+setmarkup(int markuptype)
+{
+	render->setmarkup(markuptype);
+}
+
 static void
 startmarkup(int markuptype)
 {
@@ -867,11 +1242,121 @@ utfwidth(int c)
 	return 1;
 }
 
+/* length of the span of s without control characters (including NUL) and the
+   number of codepoints in it, if stopspace is set it also ends at a space:
+   checks a word of 8 bytes at a time */
+static size_t
+textspan(const char *s, size_t len, int stopspace, size_t *ncodepoints)
+{
+	const uint64_t ones = 0x0101010101010101ULL, highs = ones * 0x80;
+	uint64_t w, d;
+	size_t i, n = 0;
+	int lt = stopspace ? ' ' + 1 : ' ';
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, sizeof(w));
+		d = w ^ (ones * 0x7f);
+		/* any byte < lt or 0x7f */
+		if ((((w - ones * lt) & ~w) | ((d - ones) & ~d)) & highs)
+			break;
+		/* subtract the continuation bytes (10xxxxxx) */
+		n += 8 - (((((w & ~(w << 1)) & highs) >> 7) * ones) >> 56);
+	}
+	for (; i < len && (unsigned char)s[i] >= lt && s[i] != 0x7f; i++) {
+		if ((s[i] & 0xc0) != 0x80)
+			n++;
+	}
+	*ncodepoints = n;
+
+	return i;
+}
+
+/* line-break class of a codepoint, see linebreak.h */
+static int
+lbclass(long cp)
+{
+	if (cp < 0 || cp > LB_MAXCP)
+		return LbAL;
+	return lb_stage2[lb_stage1[cp >> LB_BLOCKSHIFT]][cp & (LB_BLOCKSIZE - 1)];
+}
+
+/* decode the last byte added to the word buffer and check if there is a
+   line-break opportunity before the codepoint using the UAX #14 pair table.
+   Breaks at ASCII white-space and '-' are handled by hputchar(), so this is
+   only used if one of the codepoints is non-ASCII, for example CJK text */
+static void
+lbwrap(int c)
+{
+	int cls, n, start;
+
+	c &= 0xff;
+	if ((c & 0xc0) == 0x80) {
+		if (!lbcont)
+			return; /* invalid sequence */
+		lbcp = (lbcp << 6) | (c & 0x3f);
+		if (--lbcont)
+			return;
+	} else {
+		lbstart = rbuflen - 1;
+		lbcont = 0;
+		if (c < 0x80) {
+			lbcp = c;
+		} else if ((c & 0xe0) == 0xc0) {
+			lbcp = c & 0x1f;
+			lbcont = 1;
+		} else if ((c & 0xf0) == 0xe0) {
+			lbcp = c & 0x0f;
+			lbcont = 2;
+		} else if ((c & 0xf8) == 0xf0) {
+			lbcp = c & 0x07;
+			lbcont = 3;
+		} else {
+			lbcp = 0xfffd; /* invalid */
+		}
+		if (lbcont)
+			return;
+	}
+
+	cls = lbclass(lbcp);
+	/* combining marks belong to the previous codepoint (LB9, LB10) */
+	if (cls == LbCM || cls == LbZWJ) {
+		if (lbprev != -1)
+			return;
+		cls = LbAL;
+	}
+
+	if (lbprev != -1 && lbstart > 0 &&
+	    (lbcp >= 0x80 || lbprevcp >= 0x80) &&
+	    lb_pairs[lbprev][cls] == '_') {
+		/* flush the data before this codepoint as a word */
+		start = lbstart;
+		n = rbuflen - start;
+		rbuflen = start;
+		rnbufcells--; /* the codepoint is counted as 1 cell */
+		if (ncells + rnbufcells >= termwidth) {
+			putchar('\n');
+			nbytesline = 0;
+			ncells = 0;
+		}
+		hflush();
+
+		/* keep the codepoint in the buffer */
+		memmove(rbuf, rbuf + start, n);
+		rbuflen = n;
+		rnbufcells = 1;
+	}
+
+	lbprev = cls;
+	lbprevcp = lbcp;
+}
+
 /* write a character, handling state of repeated newlines, some HTML
    white-space rules, indentation and word-wrapping */
-static void
-hputchar(int c)
+static inline void
+hputchar_impl(int c, int wrap, int layout)
 {
+	char ch;
+
 	struct node *cur = &nodes[curnode];
 	cur->hasdata = 1;
 
@@ -904,20 +1389,20 @@ hputchar(int c)
 	if (!(c == '\n' || c == '\t' || !ISCNTRL((unsigned char)c)))
 		return;
 
-	if (!linewrap) {
+	/* record and keep the state as without word-wrapping */
+	if (layout) {
+		ch = c;
+		layoutrecord(c == '\n' ? 'L' : 'T', &ch, c != '\n');
+	}
+
+	if (!wrap) {
 		if (c == '\n') {
 			putchar('\n');
 			nbytesline = 0;
 			ncells = 0;
 		} else {
-			if (!nbytesline) {
-				if (curmarkup)
-					emitmarkup(0);
-				rindent();
-				/* emit code again per line, needed for GNU/less -R */
-				if (curmarkup)
-					emitmarkup(curmarkup);
-			}
+			if (!nbytesline)
+				startline();
 			putchar(c);
 			nbytesline++;
 			ncells += utfwidth(c);
@@ -936,6 +1421,7 @@ hputchar(int c)
 	if (c == '\n') {
 		putchar('\n');
 		hflush();
+		lbprev = -1;
 		return;
 	} else if (ISSPACE((unsigned char)c) || c == '-') {
 		if (ncells + rnbufcells >= termwidth) {
@@ -946,11 +1432,85 @@ hputchar(int c)
 		rbuf[rbuflen++] = c;
 		rnbufcells += utfwidth(c);
 		hflush();
+		lbprev = -1;
 		return;
 	}
 
 	rbuf[rbuflen++] = c;
 	rnbufcells += utfwidth(c);
+	lbwrap(c);
+}
+
+/* write a run of text without white-space and control characters, ncodepoints
+   is the number of codepoints in it. This is the same as hputchar_impl() for
+   each byte, but the text is copied at once: runs of ASCII text without '-'
+   have no line-break opportunities */
+static inline void
+hputtext_impl(const char *s, size_t len, size_t ncodepoints, int wrap, int layout)
+{
+	size_t i, n;
+	int room;
+
+	if (!len)
+		return;
+
+	nodes[curnode].hasdata = 1;
+	hadnewline = 0;
+	currentnewlines = 0;
+	skipinitialws = 0;
+
+	if (layout)
+		layoutrecord('T', s, len);
+
+	if (!wrap) {
+		if (!nbytesline)
+			startline();
+		fwrite(s, 1, len, stdout);
+		nbytesline += len;
+		ncells += ncodepoints;
+		return;
+	}
+
+	for (i = 0; i < len; i += n) {
+		/* the first byte of a run is checked for a line-break */
+		hputchar_impl(s[i], wrap, 0);
+		n = 1;
+		if ((unsigned char)s[i] >= 0x80)
+			continue; /* a break may follow a non-ASCII codepoint */
+
+		for (; i + n < len && (unsigned char)s[i + n] < 0x80 &&
+		     s[i + n] != '-'; n++)
+			;
+		if (n == 1)
+			continue;
+
+		/* the rest of the run is added until the word needs a wrap */
+		room = termwidth - ncells - rnbufcells;
+		if (room > (int)sizeof(rbuf) - 1 - rbuflen)
+			room = (int)sizeof(rbuf) - 1 - rbuflen;
+		if (room <= 0) {
+			n = 1;
+			continue;
+		}
+		if ((size_t)room < n - 1)
+			n = room + 1;
+		memcpy(rbuf + rbuflen, s + i + 1, n - 1);
+		rbuflen += n - 1;
+		rnbufcells += n - 1;
+
+		/* line-break state of the last ASCII codepoint, see lbwrap() */
+		lbstart = rbuflen - 1;
+		lbcont = 0;
+		lbcp = (unsigned char)s[i + n - 1];
+		lbprev = lbclass(lbcp);
+		lbprevcp = lbcp;
+	}
+}
+
+static void
+hputchar(int c)
+{
+	render->hputchar(c);
 }
 
 /* calculate indentation of current node depth, using the sum of each
@@ -958,12 +1518,7 @@ hputchar(int c)
 static int
 calcindent(void)
 {
-	int i, n = 0;
-
-	for (i = curnode; i >= 0; i--)
-		n += nodes[i].indent;
-
-	return n;
+	return nodes[curnode].parentindent + nodes[curnode].indent;
 }
 
 static void
@@ -988,38 +1543,155 @@ hprintf(const char *fmt, ...)
 	hprint(buf);
 }
 
+/* print a horizontal ruler of n cells */
 static void
-newline(void)
+printrulerwidth(int n)
 {
-	if (skipinitialws)
+	static String line;
+	static int linewidth;
+	size_t len;
+	int i;
+
+	if (n <= 0)
 		return;
-	hputchar('\n');
-}
 
-static int
-parentcontainerhasdata(int curtype, int n)
-{
-	int i;
+	/* not at the start of a line: use hprint() formatting logic */
+	if (nbytesline || rbuflen) {
+		for (; n > 0; n--)
+			hprint(str_ruler);
+		return;
+	}
 
-	for (i = n; i >= 0; i--) {
-		if (nodes[i].tag.displaytype & (DisplayList|DisplayTable))
-			break;
-		if (nodes[i].hasdata)
-			return 1;
+	/* the line is built once for the maximum width */
+	len = strlen(str_ruler);
+	if (!line.len || linewidth != termwidth) {
+		string_clear(&line);
+		for (i = 0; i < termwidth; i++)
+			string_append(&line, str_ruler, len);
+		linewidth = termwidth;
 	}
+	if (n > termwidth)
+		n = termwidth;
 
-	return 0;
+	nodes[curnode].hasdata = 1;
+	hadnewline = 0;
+	currentnewlines = 0;
+	skipinitialws = 0;
+
+	startline();
+	fwrite(line.data, 1, n * len, stdout);
+	nbytesline += n * len;
+	ncells += n;
 }
 
-/* start on a newline for the start of a block element or not */
+/* newline which is not part of the word-wrapping, such as for margins */
 static void
-startblock(void)
+rawnewline(void)
 {
-	hflush();
+	if (layoutfp)
+		layoutrecord('N', NULL, 0);
+	putchar('\n');
+	nbytesline = 0;
+	ncells = 0;
+}
+
+/* write text as is */
+static void
+rawprintf(const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+	int n;
+
+	va_start(ap, fmt);
+	if (!layoutfp) {
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	buf = ecalloc(1, n + 1);
+	va_start(ap, fmt);
+	vsnprintf(buf, n + 1, fmt, ap);
+	va_end(ap);
+	layoutrecord('X', buf, n);
+	free(buf);
+}
+
+static void
+newline(void)
+{
+	if (skipinitialws)
+		return;
+	hputchar('\n');
+}
+
+/* check if the node at depth n or one of its child nodes has data */
+static int
+hasdata(int n)
+{
+	return n < datadepth || nodes[n].hasdata;
+}
+
+/* count of nodes which have the data flag set from the root up to and
+   including node n. This does not include the data of child nodes which
+   ended, see datadepth */
+static int
+countdata(int n)
+{
+	if (n < 0)
+		return 0;
+	return nodes[n].ndata + (nodes[n].hasdata != 0);
+}
+
+/* count of list item nodes which have the data flag set from the root up to
+   and including node n */
+static int
+countlistitemdata(int n)
+{
+	if (n < 0)
+		return 0;
+	return nodes[n].nlistitemdata +
+		(nodes[n].hasdata && (nodes[n].displaytype & DisplayListItem));
+}
+
+static int
+parentcontainerhasdata(int curtype, int n)
+{
+	int c;
+
+	/* any node with data after the nearest list or table container */
+	c = nodes[n].containerdepth;
+	if (c < n && c + 1 < datadepth)
+		return 1;
+	return countdata(n) - countdata(c) > 0;
+}
+
+/* check if there is a list item with data after the nearest list of node n */
+static int
+parentlistitemhasdata(int n)
+{
+	int l, m;
+
+	l = nodes[n].listdepth;
+	m = n < datadepth ? n : datadepth - 1;
+	if (m > l && nodes[m].listitemdepth > l)
+		return 1;
+	return countlistitemdata(n) - countlistitemdata(l) > 0;
+}
+
+/* start on a newline for the start of a block element or not */
+static void
+startblock(void)
+{
+	hflush();
 	whitespace_mode &= ~2; /* no characters on this line yet */
 	if (nbytesline <= 0)
 		return;
-	if (!hadnewline && curnode >= 0 && nodes[curnode - 1].hasdata)
+	if (!hadnewline && curnode >= 0 && hasdata(curnode - 1))
 		hputchar('\n');
 }
 
@@ -1035,19 +1707,137 @@ endblock(void)
 		hputchar('\n');
 }
 
-/* print one character safely: no control characters,
-   handle HTML white-space rules */
+/* length of the span of s with only white-space: skips words of spaces */
+static size_t
+spacespan(const char *s, size_t len)
+{
+	const uint64_t spaces = 0x2020202020202020ULL;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, sizeof(w));
+		if (w != spaces)
+			break;
+	}
+	for (; i < len && ISSPACE((unsigned char)s[i]); i++)
+		;
+	return i;
+}
+
+/* print text safely: no control characters, handle HTML white-space rules,
+   processes runs of text and white-space at once */
+static inline void
+printtext_impl(const char *s, size_t len, int wrap, int layout)
+{
+	size_t i, n, cells;
+
+	for (i = 0; i < len; i += n) {
+		if ((n = textspan(s + i, len - i, 1, &cells))) {
+			whitespace_mode = 2;
+			hputtext_impl(s + i, n, cells, wrap, layout);
+		} else if ((n = spacespan(s + i, len - i))) {
+			/* collapse white-space to a single space */
+			if (whitespace_mode == 2)
+				hputchar_impl(' ', wrap, layout);
+			whitespace_mode |= 1;
+		} else {
+			whitespace_mode = 2; /* skip control character */
+			n = 1;
+		}
+	}
+}
+
 static void
-printc(int c)
+printtext(const char *s, size_t len)
 {
-	if (ISSPACE((unsigned char)c)) {
-		if (whitespace_mode == 2)
-			hputchar(' ');
-		whitespace_mode |= 1;
+	render->printtext(s, len);
+}
+
+/* specialized render functions for the options: line-wrapping, ANSI and
+   writing the layout format */
+#define RENDERER(name, wrap, ansi, layout) \
+	static void hputchar_##name(int c) { hputchar_impl(c, wrap, layout); } \
+	static void printtext_##name(const char *s, size_t len) { printtext_impl(s, len, wrap, layout); } \
+	static void setmarkup_##name(int m) { setmarkup_impl(m, wrap, ansi, layout); }
+RENDERER(plain, 0, 0, 0)
+RENDERER(ansi, 0, 1, 0)
+RENDERER(wrap, 1, 0, 0)
+RENDERER(wrapansi, 1, 1, 0)
+RENDERER(layout, 0, 0, 1)
+#undef RENDERER
+
+/* indexed by line-wrapping * 2 + ANSI, the last is for the layout format */
+static const struct renderer renderers[] = {
+	{ hputchar_plain,    printtext_plain,    setmarkup_plain    },
+	{ hputchar_ansi,     printtext_ansi,     setmarkup_ansi     },
+	{ hputchar_wrap,     printtext_wrap,     setmarkup_wrap     },
+	{ hputchar_wrapansi, printtext_wrapansi, setmarkup_wrapansi },
+	{ hputchar_layout,   printtext_layout,   setmarkup_layout   }
+};
+
+/* print a horizontal ruler for the current indentation */
+static void
+printruler(void)
+{
+	const struct renderer *r;
+
+	if (layoutfp) {
+		/* the width is known when rendering, keep the state as text */
+		layoutrecord('R', NULL, 0);
+		r = render;
+		render = &renderers[0];
+		printrulerwidth(termwidth - indent - defaultindent);
+		render = r;
 	} else {
-		whitespace_mode = 2;
-		if (!ISCNTRL((unsigned char)c))
-			hputchar(c);
+		printrulerwidth(termwidth - indent - defaultindent);
+	}
+}
+
+/* print preformatted data literally */
+static void
+printpredata(const char *s, size_t len)
+{
+	size_t i = 0, n, cells;
+
+	if (layoutfp)
+		layoutrecord('P', s, len);
+
+	while (i < len && *s) {
+		/* copy a run of text at once */
+		if ((n = textspan(s, len - i, 0, &cells))) {
+			if (!nbytesline)
+				startline();
+			fwrite(s, 1, n, stdout);
+			nbytesline += n;
+			/* incorrectly assume 1 rune is 1 cell for now */
+			ncells += cells;
+			s += n;
+			i += n;
+			continue;
+		}
+
+		switch (*s) {
+		case '\n':
+			putchar('\n');
+			nbytesline = 0;
+			ncells = 0;
+			break;
+		case '\t':
+			hadnewline = 0;
+			if (!nbytesline)
+				startline();
+
+			/* TAB to 8 spaces */
+			fputs("        ", stdout);
+			nbytesline += DEFAULT_TABSTOP;
+			ncells += DEFAULT_TABSTOP;
+			break;
+		default:
+			break; /* skip other control characters */
+		}
+		s++;
+		i++;
 	}
 }
 
@@ -1079,330 +1869,1127 @@ printpre(const char *s, size_t len)
 		cur->hasdata = 1;
 	}
 
-	for (; *s && i < len; s++, i++) {
-		switch (*s) {
-		case '\n':
-			putchar('\n');
-			nbytesline = 0;
-			ncells = 0;
-			break;
-		case '\t':
-			hadnewline = 0;
-			if (!nbytesline) {
-				if (curmarkup)
-					emitmarkup(0);
-				rindent();
-				/* emit code again per line, needed for GNU/less -R */
-				if (curmarkup)
-					emitmarkup(curmarkup);
-			}
+	printpredata(s, len - i);
+}
 
-			/* TAB to 8 spaces */
-			fputs("        ", stdout);
-			nbytesline += DEFAULT_TABSTOP;
-			ncells += DEFAULT_TABSTOP;
-			break;
-		default:
-			if (ISCNTRL((unsigned char)*s))
-				continue;
+/* check if one of the parent nodes of the current node has a display type */
+static int
+hasparenttype(int findtype)
+{
+	return nodes[curnode].parenttypes & findtype;
+}
 
-			if (!nbytesline) {
-				if (curmarkup)
-					emitmarkup(0);
-				rindent();
-				/* emit code again per line, needed for GNU/less -R */
-				if (curmarkup)
-					emitmarkup(curmarkup);
-			}
+/* get a string of a node by its offset in the string pool */
+static const char *
+nodestr(size_t offset)
+{
+	return nodes_strpool.data + offset;
+}
 
-			putchar(*s);
-			nbytesline++;
-			/* start of rune: incorrectly assume 1 rune is 1 cell for now */
-			ncells += utfwidth((unsigned char)*s);
-		}
-	}
+/* add a string for the current node to the string pool, returns the offset */
+static size_t
+nodestradd(const char *s, size_t len)
+{
+	size_t offset;
+
+	offset = nodes_strpool.len;
+	string_append(&nodes_strpool, s, len);
+	string_append(&nodes_strpool, "", 1); /* NUL-terminate */
+	nodes_strings[curnode].end = nodes_strpool.len;
+
+	return offset;
+}
+
+/* tag name of the node at depth n */
+static const char *
+nodetagname(int n)
+{
+	if (nodes[n].tag == &unknowntag)
+		return nodestr(nodes_strings[n].tagname);
+	return nodes[n].tag->name;
+}
+
+/* check if the node at depth n is the tag t, found is the tag information of
+   t from the tags table or NULL */
+static int
+isnodetag(int n, const struct tag *found, const char *t)
+{
+	if (found)
+		return nodes[n].tag == found;
+	return nodes[n].tag == &unknowntag &&
+		!tagcmp(nodestr(nodes_strings[n].tagname), t);
+}
+
+
+static uint64_t
+keyhash(enum KeyType type, const char *s, size_t len)
+{
+	return hash64(0xcbf29ce484222325ULL ^ type, s, len);
+}
+
+static void
+bloomadd(struct bloom *b, uint64_t h)
+{
+	b->w[(h >> 6) % BLOOM_WORDS] |= 1ULL << (h & 63);
+	h >>= 32;
+	b->w[(h >> 6) % BLOOM_WORDS] |= 1ULL << (h & 63);
 }
 
-static struct node *
-findparenttype(int cur, int findtype)
+/* check if the filter a can contain all keys of the filter b */
+static int
+bloomhas(const struct bloom *a, const struct bloom *b)
 {
 	int i;
 
-	for (i = cur; i >= 0; i--) {
-		if ((nodes[i].tag.displaytype & findtype))
-			return &nodes[i];
+	for (i = 0; i < BLOOM_WORDS; i++) {
+		if (b->w[i] & ~a->w[i])
+			return 0;
 	}
-	return NULL;
+	return 1;
 }
 
-static int
-isclassmatch(const char *haystack, const char *needle)
+/* set the Bloom filter of the node at depth d from the filter of its parent
+   and the keys of the node */
+static void
+nodebloom(int d)
 {
-	const char *p;
-	size_t needlelen;
-	size_t matched = 0;
+	struct bloom *b = &nodes_bloom[d];
+	const char *s;
+	size_t i;
 
-	needlelen = strlen(needle);
-	for (p = haystack; *p; p++) {
-		if (ISSPACE((unsigned char)*p)) {
-			matched = 0;
-			continue;
+	if (d > 0)
+		*b = nodes_bloom[d - 1];
+	else
+		memset(b, 0, sizeof(*b));
+
+	s = nodetagname(d);
+	bloomadd(b, keyhash(KeyTag, s, strlen(s)));
+	s = nodestr(nodes_strings[d].id);
+	if (*s)
+		bloomadd(b, keyhash(KeyId, s, strlen(s)));
+	for (i = 0; i < nodes_classes[d].len; i++)
+		bloomadd(b, nodes_classes[d].hashes[i]);
+}
+
+/* hash the white-space separated classes of the node at depth d once, for
+   matching selectors */
+static void
+nodeclasses(int d, const char *s, size_t len)
+{
+	struct nodeclasses *nc = &nodes_classes[d];
+	const char *e, *end = s + len;
+
+	nc->len = 0;
+	for (; s < end; s = e) {
+		for (; s < end && ISSPACE((unsigned char)*s); s++)
+			;
+		for (e = s; e < end && !ISSPACE((unsigned char)*e); e++)
+			;
+		if (e == s)
+			break;
+		if (nc->len >= nc->cap) {
+			nc->cap = nc->cap ? nc->cap * 2 : 8;
+			nc->hashes = erealloc(nc->hashes, nc->cap * sizeof(*nc->hashes));
 		}
-		if (needle[matched] == *p)
-			matched++;
-		else
-			matched = 0;
-		if (matched == needlelen) {
-			if (*(p + 1) == '\0' || ISSPACE((unsigned char)*(p + 1)))
-				return 1;
+		nc->hashes[nc->len++] = keyhash(KeyClass, s, e - s);
+	}
+}
+
+/* characters which end a name in a selector */
+#define SELECTOR_DELIM ".#@[]():>,\"' \t\n\v\f\r"
+
+/* parse the argument of :nth-child(): an+b, "odd" or "even" and white-space
+   is ignored, returns the end after ')' or NULL on error */
+static const char *
+compilenth(const char *s, struct selectornode *sn)
+{
+	char buf[64], *p, *n, *e;
+	size_t len = 0;
+
+	for (; *s && *s != ')'; s++) {
+		if (ISSPACE((unsigned char)*s))
+			continue;
+		if (len + 1 >= sizeof(buf))
+			return NULL;
+		buf[len++] = TOLOWER((unsigned char)*s);
+	}
+	if (*s != ')' || !len)
+		return NULL;
+	buf[len] = '\0';
+
+	sn->hasnth = 1;
+	sn->ntha = sn->nthb = 0;
+	if (!strcmp(buf, "odd")) {
+		sn->ntha = 2;
+		sn->nthb = 1;
+	} else if (!strcmp(buf, "even")) {
+		sn->ntha = 2;
+	} else if ((n = strchr(buf, 'n'))) {
+		/* an, n, -n, +n */
+		if (n == buf || (n == buf + 1 && buf[0] == '+'))
+			sn->ntha = 1;
+		else if (n == buf + 1 && buf[0] == '-')
+			sn->ntha = -1;
+		else if ((sn->ntha = strtol(buf, &e, 10)), e != n)
+			return NULL;
+		/* +b, -b */
+		p = n + 1;
+		if (*p) {
+			if (*p != '+' && *p != '-')
+				return NULL;
+			sn->nthb = strtol(p, &e, 10);
+			if (e == p + 1 || *e)
+				return NULL;
 		}
+	} else {
+		sn->nthb = strtol(buf, &e, 10);
+		if (*e)
+			return NULL;
 	}
 
-	return 0;
+	return s + 1;
 }
 
-/* very limited CSS-like selector, supports: main, main#id, main.class,
-   ".class", "#id", "ul li a" */
-static int
-compileselector(const char *sel, struct selectornode *nodes, size_t maxnodes)
+/* parse an attribute: name], name=value], name^=value], the value can be
+   quoted. Returns the end after ']' or NULL on error */
+static const char *
+compileattr(const char *s, struct selectornode *sn)
 {
-	int depth = 0, len;
-	long l;
-	const char *s, *start;
-	char tmp[256];
-	int nameset = 0;
+	struct selectorattr *a;
+	const char *e;
+	int q;
 
-	memset(&nodes[0], 0, sizeof(nodes[0]));
-	nodes[0].index = -1;
+	sn->attrs = erealloc(sn->attrs, (sn->nattrs + 1) * sizeof(*sn->attrs));
+	a = &sn->attrs[sn->nattrs++];
+	memset(a, 0, sizeof(*a));
 
-	s = sel;
-	for (; *s && ISSPACE((unsigned char)*s); s++)
+	for (; ISSPACE((unsigned char)*s); s++)
+		;
+	e = s + strcspn(s, "^=]" " \t\n\v\f\r");
+	if (e == s)
+		return NULL;
+	a->name = estrndup(s, e - s);
+	for (s = e; ISSPACE((unsigned char)*s); s++)
 		;
 
-	start = s;
-	for (; ; s++) {
-		/* end of tag */
-		if (!nameset &&
-		    (*s == '#' || *s == '.' || *s == '@' ||
-		     *s == '\0' || ISSPACE((unsigned char)*s))) {
-			nameset = 1;
-			len = s - start; /* tag name */
-			if (len >= sizeof(tmp))
-				return 0;
-			if (len)
-				memcpy(tmp, start, len);
-			tmp[len] = '\0';
-
-			memcpy(nodes[depth].tagname, tmp, len + 1);
+	if (*s == '^' && s[1] == '=') {
+		a->op = '^';
+		s += 2;
+	} else if (*s == '=') {
+		a->op = '=';
+		s++;
+	}
+	if (a->op) {
+		for (; ISSPACE((unsigned char)*s); s++)
+			;
+		if (*s == '"' || *s == '\'') {
+			q = *s++;
+			if (!(e = strchr(s, q)))
+				return NULL;
+			a->value = estrndup(s, e - s);
+			s = e + 1;
+		} else {
+			e = s + strcspn(s, "]" " \t\n\v\f\r");
+			a->value = estrndup(s, e - s);
+			s = e;
 		}
+		a->valuelen = strlen(a->value);
+		for (; ISSPACE((unsigned char)*s); s++)
+			;
+	}
+	if (*s != ']')
+		return NULL;
+	selattrs = 1;
 
-		/* end */
-		if (*s == '\0' || ISSPACE((unsigned char)*s)) {
-			for (; ISSPACE((unsigned char)*s); s++)
-				;
-			start = s; /* start of a new tag */
-			depth++;
-			if (depth >= maxnodes)
-				return 0;
+	return s + 1;
+}
 
-			nameset = 0;
-			memset(&nodes[depth], 0, sizeof(nodes[depth]));
-			nodes[depth].index = -1;
+/* very limited CSS-like selector, supports: main, main#id, main.class,
+   main.class1.class2, ".class", "#id", "ul li a", "ul > li", attributes
+   [name], [name=value], [name^=value] and :first-child, :nth-child(an+b).
+   Returns the end of the selector node or NULL on error */
+static const char *
+compileselectornode(const char *s, struct selectornode *sn)
+{
+	const char *e;
+	char *p;
+	long l;
+	int c;
 
-			/* end of selector */
-			if (*s == '\0')
-				break;
-		}
+	sn->tagname = sn->id = "";
+	sn->index = -1;
 
-		/* index */
-		if (*s == '@') {
-			len = strcspn(s + 1, ".#@ \t\n");
-			if (len >= sizeof(tmp))
-				return 0;
-			memcpy(tmp, s + 1, len);
-			tmp[len] = '\0';
+	/* tag name */
+	e = s + strcspn(s, SELECTOR_DELIM);
+	if (e > s) {
+		sn->tagname = p = estrndup(s, e - s);
+		for (; *p; p++)
+			*p = TOLOWER((unsigned char)*p);
+	}
 
-			l = strtol(tmp, NULL, 10);
+	for (s = e; *s && *s != '>' && !ISSPACE((unsigned char)*s); ) {
+		c = *s++;
+		e = s + strcspn(s, SELECTOR_DELIM);
+		switch (c) {
+		case '#': /* id, the last one is used */
+			if (sn->id[0])
+				free((char *)sn->id);
+			sn->id = e > s ? estrndup(s, e - s) : "";
+			s = e;
+			break;
+		case '.': /* class */
+			sn->classes = erealloc(sn->classes,
+				(sn->nclasses + 1) * sizeof(*sn->classes));
+			sn->classes[sn->nclasses++] = keyhash(KeyClass, s, e - s);
+			s = e;
+			break;
+		case '@': /* index */
+			l = strtol(s, NULL, 10);
 			if (l >= 0)
-				nodes[depth].index = l;
-			s += len;
-			start = s + 1;
-			continue;
+				sn->index = l;
+			s = e;
+			break;
+		case '[': /* attribute */
+			if (!(s = compileattr(s, sn)))
+				return NULL;
+			break;
+		case ':': /* pseudo-class */
+			if (e - s == 11 && !strncmp(s, "first-child", 11)) {
+				sn->hasnth = 1;
+				sn->ntha = 0;
+				sn->nthb = 1;
+				s = e;
+			} else if (e - s == 9 && !strncmp(s, "nth-child", 9) &&
+			           *e == '(') {
+				if (!(s = compilenth(e + 1, sn)))
+					return NULL;
+			} else {
+				return NULL;
+			}
+			break;
+		default:
+			return NULL;
 		}
+	}
 
-		/* id */
-		if (*s == '#') {
-			len = strcspn(s + 1, ".#@ \t\n");
-			if (len >= sizeof(tmp))
-				return 0;
-			memcpy(tmp, s + 1, len);
-			tmp[len] = '\0';
-			memcpy(nodes[depth].id, tmp, len + 1);
-			s += len;
-			start = s + 1;
-			continue;
-		}
+	return s;
+}
 
-		/* class */
-		if (*s == '.') {
-			len = strcspn(s + 1, ".#@ \t\n");
-			if (len >= sizeof(tmp))
-				return 0;
-			memcpy(tmp, s + 1, len);
-			tmp[len] = '\0';
-			/* allow only one classname for now */
-			memcpy(nodes[depth].classnames, tmp, len + 1);
-			s += len;
-			start = s + 1;
-			continue;
+static void
+freeselector(struct selector *sel)
+{
+	struct selectornode *sn;
+	size_t j;
+	int i;
+
+	for (i = 0; i < sel->depth; i++) {
+		sn = &sel->nodes[i];
+		if (sn->tagname[0])
+			free((char *)sn->tagname);
+		if (sn->id[0])
+			free((char *)sn->id);
+		for (j = 0; j < sn->nattrs; j++) {
+			free((char *)sn->attrs[j].name);
+			free((char *)sn->attrs[j].value);
 		}
+		free(sn->attrs);
+		free(sn->classes);
 	}
-
-	return depth;
+	free(sel->nodes);
+	free(sel);
 }
 
+/* compile a selector, returns NULL on a syntax error */
 static struct selector *
 newselector(const char *q)
 {
 	struct selector *sel;
-	int r;
+	struct selectornode *sn;
+	const char *s;
+	size_t j;
+	int i, n = 0, ischild = 0;
 
 	sel = ecalloc(1, sizeof(*sel));
-	sel->text = estrdup(q);
 
-	r = compileselector(sel->text, sel->nodes, LEN(sel->nodes));
-	if (r <= 0) {
-		free(sel);
+	/* nodes separated by white-space or ">" */
+	for (s = q; ; ) {
+		for (; ISSPACE((unsigned char)*s); s++)
+			;
+		if (*s == '>') {
+			if (!n)
+				break;
+			ischild = 1;
+			s++;
+			continue;
+		}
+		if (*s == '\0' || n == SELECTOR_MAXNODES)
+			break;
+
+		sel->nodes = erealloc(sel->nodes, (n + 1) * sizeof(*sel->nodes));
+		sn = &sel->nodes[n++];
+		memset(sn, 0, sizeof(*sn));
+		sn->ischild = ischild;
+		if (ischild) {
+			sel->haschild = 1;
+			sel->childmask |= 1ULL << (n - 1);
+		}
+		ischild = 0;
+		sel->depth = n;
+		if (!(s = compileselectornode(s, sn)))
+			break;
+	}
+	if (!s || *s || ischild) {
+		freeselector(sel);
 		return NULL;
 	}
-	sel->depth = r;
+	/* empty selector: matches any node */
+	if (!n) {
+		sel->nodes = ecalloc(1, sizeof(*sel->nodes));
+		compileselectornode("", &sel->nodes[n++]);
+	}
+	sel->depth = n;
+
+	/* keys of the parent nodes */
+	for (i = 0; i < n - 1; i++) {
+		sn = &sel->nodes[i];
+		if (sn->tagname[0])
+			bloomadd(&sel->bloom, keyhash(KeyTag, sn->tagname, strlen(sn->tagname)));
+		if (sn->id[0])
+			bloomadd(&sel->bloom, keyhash(KeyId, sn->id, strlen(sn->id)));
+		for (j = 0; j < sn->nclasses; j++)
+			bloomadd(&sel->bloom, sn->classes[j]);
+	}
+
+	/* key of the last node, the most specific one */
+	sn = &sel->nodes[n - 1];
+	sel->haskey = 1;
+	if (sn->id[0])
+		sel->keyhash = keyhash(KeyId, sn->id, strlen(sn->id));
+	else if (sn->nclasses)
+		sel->keyhash = sn->classes[0];
+	else if (sn->tagname[0])
+		sel->keyhash = keyhash(KeyTag, sn->tagname, strlen(sn->tagname));
+	else
+		sel->haskey = 0;
 
 	return sel;
 }
 
-static struct selectors *
-compileselectors(const char *q)
+/* add selectors separated by a comma, returns 0 on a syntax error */
+static int
+addselectors(struct selectors *sels, const char *q)
 {
-	struct selectors *sels = NULL;
 	struct selector *sel;
 	const char *start;
 	char *qe;
-	int count = 0;
-	size_t siz;
-
-	sels = ecalloc(1, sizeof(*sels));
+	int quote = 0, nest = 0;
 
 	start = q;
 	for (; ; q++) {
-		if (*q == ',' || *q == '\0') {
+		/* no separator in an attribute or :nth-child() */
+		if (quote) {
+			if (*q == quote)
+				quote = 0;
+			else if (*q == '\0')
+				return 0;
+			continue;
+		} else if (*q == '"' || *q == '\'') {
+			quote = *q;
+			continue;
+		} else if (*q == '[' || *q == '(') {
+			nest++;
+		} else if ((*q == ']' || *q == ')') && nest > 0) {
+			nest--;
+		}
+
+		if ((*q == ',' && !nest) || *q == '\0') {
 			qe = estrndup(start, q - start);
 			sel = newselector(qe);
 			free(qe);
+			if (!sel)
+				return 0;
 
 			/* add new selector */
-			siz = (count + 1) * sizeof(struct selector *);
-			sels->selectors = erealloc(sels->selectors, siz);
-			sels->selectors[count] = sel;
-			count++;
+			sels->selectors = erealloc(sels->selectors,
+				(sels->count + 1) * sizeof(struct selector *));
+			sels->selectors[sels->count++] = sel;
 
 			if (*q == '\0')
 				break;
 			start = q + 1;
 		}
 	}
-	sels->count = count;
 
-	return sels;
+	return 1;
 }
 
-/* very limited CSS-like matcher, supports: main, main#id, main.class,
-   ".class", "#id", "ul li a" */
-static int
-iscssmatch(struct selector *sel, struct node *root, int maxdepth)
-{
-	int d, md = 0;
-
-	for (d = 0; d <= maxdepth; d++) {
-		/* tag matched? */
-		if (sel->nodes[md].tagname[0] &&
-		    strcasecmp(sel->nodes[md].tagname, root[d].tagname))
-			continue; /* no */
-
-		/* id matched? */
-		if (sel->nodes[md].id[0] && strcmp(sel->nodes[md].id, root[d].id))
-			continue; /* no */
-
-		/* class matched, for now allow only one classname in the selector,
-		   matching multiple classnames */
-		if (sel->nodes[md].classnames[0] &&
-		    !isclassmatch(root[d].classnames, sel->nodes[md].classnames))
-			continue; /* no */
-
-		/* index matched */
-		if (sel->nodes[md].index != -1 &&
-		    (d == 0 ||
-		    root[d - 1].nchildren == 0 ||
-		    sel->nodes[md].index != root[d - 1].nchildren - 1))
-			continue;
+/* add selectors from the data of a rules file, one per line. Element hiding
+   rules of ad-blockers are accepted: empty lines and lines starting with '!'
+   or '[' are ignored, for generic rules "##selector" the selector is used
+   and rules for specific sites, exceptions and selectors which are not
+   supported are skipped */
+static void
+loadselectors(struct selectors *sels, char *data)
+{
+	char *line, *e, *p;
 
-		md++;
-		/* all matched of one selector */
-		if (md == sel->depth)
-			return 1;
-	}
+	for (line = data; *line; line = e) {
+		if ((e = strchr(line, '\n')))
+			*e++ = '\0';
+		else
+			e = line + strlen(line);
 
-	return 0;
+		for (p = line + strlen(line); p > line && ISSPACE((unsigned char)p[-1]); p--)
+			;
+		*p = '\0';
+
+		if (!*line || *line == '!' || *line == '[' || strstr(line, "#@#"))
+			continue;
+		if ((p = strstr(line, "##"))) {
+			if (p != line)
+				continue;
+			line += 2;
+		}
+		addselectors(sels, line);
+	}
 }
 
-static int
-iscssmatchany(struct selectors *sels, struct node *root, int maxdepth)
+/* index the selectors by the key of their last node, for large lists such
+   as rules files: a node is then only checked with the selectors for its
+   tag name, id and classes. Smaller lists keep a match state per node */
+static void
+indexselectors(struct selectors *sels)
 {
 	struct selector *sel;
-	int i;
+	size_t i, h;
 
-	for (i = 0; i < sels->count; i++) {
-		sel = sels->selectors[i];
-		if (iscssmatch(sel, root, maxdepth))
+	if (sels->count < SELECTORS_INDEXMIN)
+		return;
+
+	for (sels->tablesize = 16; sels->tablesize < sels->count * 2; sels->tablesize *= 2)
+		;
+	free(sels->table);
+	sels->table = ecalloc(sels->tablesize, sizeof(*sels->table));
+	sels->other = NULL;
+
+	/* add in reverse so the buckets are in the order of the selectors */
+	for (i = sels->count; i > 0; i--) {
+		sel = sels->selectors[i - 1];
+		if (sel->haskey) {
+			h = sel->keyhash & (sels->tablesize - 1);
+			sel->next = sels->table[h];
+			sels->table[h] = sel;
+		} else {
+			sel->next = sels->other;
+			sels->other = sel;
+		}
+	}
+}
+
+/* check if the node at depth d has the attribute of the selector */
+static int
+isattrmatch(struct selectorattr *a, int d)
+{
+	const char *s, *end, *v;
+	size_t vl;
+
+	s = nodestr(nodes_strings[d].attrs);
+	end = s + nodes_strings[d].attrslen;
+	for (; s < end; s = v + vl + 1) {
+		v = s + strlen(s) + 1;
+		vl = strlen(v);
+		if (attrcmp(s, a->name))
+			continue;
+		switch (a->op) {
+		case 0:
+			return 1;
+		case '=':
+			if (vl == a->valuelen && !memcmp(v, a->value, vl))
+				return 1;
+			break;
+		case '^':
+			if (a->valuelen && vl >= a->valuelen &&
+			    !memcmp(v, a->value, a->valuelen))
+				return 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* check if the node at depth d matches the selector node */
+static int
+isselectornodematch(struct selectornode *sn, int d)
+{
+	struct nodeclasses *nc;
+	size_t i, j;
+	long pos;
+
+	/* tag matched? */
+	if (sn->tagname[0] && strcasecmp(sn->tagname, nodetagname(d)))
+		return 0;
+
+	/* id matched? */
+	if (sn->id[0] && strcmp(sn->id, nodestr(nodes_strings[d].id)))
+		return 0;
+
+	/* all classes matched? */
+	nc = &nodes_classes[d];
+	for (i = 0; i < sn->nclasses; i++) {
+		for (j = 0; j < nc->len && nc->hashes[j] != sn->classes[i]; j++)
+			;
+		if (j == nc->len)
+			return 0;
+	}
+
+	/* index matched */
+	if (sn->index != -1 &&
+	    (d == 0 ||
+	    nodes[d - 1].nchildren == 0 ||
+	    sn->index != nodes[d - 1].nchildren - 1))
+		return 0;
+
+	/* position an+b matched, the child count of the parent is the position
+	   of the node while it is open */
+	if (sn->hasnth) {
+		if (d == 0)
+			return 0;
+		pos = nodes[d - 1].nchildren - sn->nthb;
+		if (sn->ntha == 0 ? pos != 0 :
+		    (pos / sn->ntha < 0 || pos % sn->ntha != 0))
+			return 0;
+	}
+
+	/* all attributes matched? */
+	for (i = 0; i < sn->nattrs; i++) {
+		if (!isattrmatch(&sn->attrs[i], d))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* check if the selector nodes up to md match, node md on the node at depth d
+   and the others on its parents: try each parent for a descendant */
+static int
+isselectormatchat(struct selector *sel, int md, int d)
+{
+	if (!isselectornodematch(&sel->nodes[md], d))
+		return 0;
+	if (md == 0)
+		return 1;
+	if (sel->nodes[md].ischild)
+		return d > 0 && isselectormatchat(sel, md - 1, d - 1);
+	for (d--; d >= 0; d--) {
+		if (isselectormatchat(sel, md - 1, d))
+			return 1;
+	}
+	return 0;
+}
+
+/* check if the selector matches with its last node on the node at depth d
+   and the other nodes on its parents */
+static int
+isselectormatch(struct selector *sel, int d)
+{
+	int md = sel->depth - 1;
+
+	/* the parents must have the keys of the other nodes */
+	if (md > 0 && (d == 0 || !bloomhas(&nodes_bloom[d - 1], &sel->bloom)))
+		return 0;
+
+	if (sel->haschild)
+		return isselectormatchat(sel, md, d);
+
+	/* only descendants: the nearest matching parent can be used */
+	if (!isselectornodematch(&sel->nodes[md], d))
+		return 0;
+	for (d--; md > 0 && d >= 0; d--) {
+		if (isselectornodematch(&sel->nodes[md - 1], d))
+			md--;
+	}
+	return md == 0;
+}
+
+/* check the selectors in the index with the key hash h */
+static int
+iskeymatch(struct selectors *sels, uint64_t h, int d)
+{
+	struct selector *sel;
+
+	for (sel = sels->table[h & (sels->tablesize - 1)]; sel; sel = sel->next) {
+		if (sel->keyhash == h && isselectormatch(sel, d))
+			return 1;
+	}
+	return 0;
+}
+
+/* check if a selector matches the node at depth d: only the selectors with
+   the tag name, id or a class of the node as key are checked */
+static int
+isnodeselectorsmatch(struct selectors *sels, int d)
+{
+	struct selector *sel;
+	const char *s;
+	size_t i;
+
+	s = nodetagname(d);
+	if (iskeymatch(sels, keyhash(KeyTag, s, strlen(s)), d))
+		return 1;
+	s = nodestr(nodes_strings[d].id);
+	if (*s && iskeymatch(sels, keyhash(KeyId, s, strlen(s)), d))
+		return 1;
+	for (i = 0; i < nodes_classes[d].len; i++) {
+		if (iskeymatch(sels, nodes_classes[d].hashes[i], d))
+			return 1;
+	}
+	for (sel = sels->other; sel; sel = sel->next) {
+		if (isselectormatch(sel, d))
 			return 1;
 	}
 	return 0;
 }
 
+/* update the match state of the selectors for the node at depth d from the
+   state of its parent, so the node tree is not walked for each selector.
+   Indexed lists are checked by the key of the node instead. Returns 1 if a
+   selector matched the node or one of its parents */
+static int
+selectorsmatch(struct selectors *sels, int d)
+{
+	struct selector *sel;
+	struct selectorstate *st, *pst;
+	uint64_t next, at;
+	size_t i;
+	int k;
+
+	if ((size_t)d >= sels->capnodes ||
+	    (!sels->table && sels->nstates != sels->count)) {
+		sels->matched = erealloc(sels->matched, ncapnodes);
+		if (!sels->table) {
+			sels->states = erealloc(sels->states,
+				ncapnodes * sels->count * sizeof(*sels->states));
+			sels->nstates = sels->count;
+		}
+		sels->capnodes = ncapnodes;
+	}
+
+	/* a parent matched: the state of the selectors is not needed anymore */
+	if (d > 0 && sels->matched[d - 1])
+		return (sels->matched[d] = 1);
+	if (sels->table)
+		return (sels->matched[d] = isnodeselectorsmatch(sels, d));
+
+	sels->matched[d] = 0;
+	st = sels->states + d * sels->count;
+	pst = st - sels->count;
+	for (i = 0; i < sels->count; i++) {
+		sel = sels->selectors[i];
+		/* the first node or a node after a matched node: on the parent
+		   for a child, else on the parent or one of its parents */
+		next = 1;
+		if (d > 0)
+			next |= ((pst[i].at << 1) & sel->childmask) |
+				((pst[i].any << 1) & ~sel->childmask);
+		at = 0;
+		for (k = 0; k < sel->depth; k++) {
+			if ((next >> k) & 1 &&
+			    isselectornodematch(&sel->nodes[k], d))
+				at |= 1ULL << k;
+		}
+		st[i].at = at;
+		st[i].any = (d > 0 ? pst[i].any : 0) | at;
+		/* all matched of one selector */
+		if ((at >> (sel->depth - 1)) & 1) {
+			sels->matched[d] = 1;
+			break;
+		}
+	}
+
+	return sels->matched[d];
+}
+
+static struct siteprofile *
+findsiteprofile(const char *host, size_t len)
+{
+	return hashget(&siteprofiles, hash64(0xcbf29ce484222325ULL, host, len),
+	               host, len);
+}
+
+/* load the per-site profiles, each line: host option argument. The options
+   are -s selector, -u selector and -n count */
+static void
+loadsiteprofiles(const char *path, char *data)
+{
+	struct siteprofile *sp;
+	String *sels;
+	char *line, *e, *host, *opt, *arg, *p;
+	size_t len, lineno = 0;
+
+	for (line = data; *line; line = e) {
+		lineno++;
+		if ((e = strchr(line, '\n')))
+			*e++ = '\0';
+		else
+			e = line + strlen(line);
+
+		for (p = line + strlen(line); p > line && ISSPACE((unsigned char)p[-1]); p--)
+			;
+		*p = '\0';
+		for (; ISSPACE((unsigned char)*line); line++)
+			;
+		if (!*line || *line == '#')
+			continue;
+
+		/* host, option and the rest of the line as argument */
+		host = line;
+		for (p = host; *p && !ISSPACE((unsigned char)*p); p++)
+			*p = TOLOWER((unsigned char)*p);
+		for (; ISSPACE((unsigned char)*p); p++)
+			*p = '\0';
+		opt = p;
+		for (; *p && !ISSPACE((unsigned char)*p); p++)
+			;
+		for (; ISSPACE((unsigned char)*p); p++)
+			*p = '\0';
+		arg = p;
+		if (!*arg || opt[0] != '-' || !opt[1] || opt[2])
+			errx(1, "%s:%zu: invalid line", path, lineno);
+
+		len = strlen(host);
+		if (!(sp = findsiteprofile(host, len))) {
+			sp = ecalloc(1, sizeof(*sp));
+			sp->host = host;
+			hashput(&siteprofiles, hash64(0xcbf29ce484222325ULL, host, len),
+			        host, len, sp);
+		}
+
+		switch (opt[1]) {
+		case 's':
+		case 'u':
+			sels = opt[1] == 's' ? &sp->show : &sp->hide;
+			if (sels->len)
+				string_append(sels, ",", 1);
+			string_append(sels, arg, strlen(arg));
+			break;
+		case 'n':
+			if ((sp->maxmatches = strtol(arg, NULL, 10)) < 1)
+				errx(1, "%s:%zu: invalid count", path, lineno);
+			break;
+		default:
+			errx(1, "%s:%zu: invalid option: %s", path, lineno, opt);
+		}
+	}
+}
+
+/* add the selectors of the profile for the host, or the nearest parent
+   domain, to the selectors used. Only the first call is used: the host of
+   the document base */
+static void
+applysiteprofile(const char *host, size_t len)
+{
+	static int applied;
+	struct siteprofile *sp;
+	const char *s, *e = host + len;
+	int d;
+
+	if (applied)
+		return;
+	applied = 1;
+
+	for (s = host; ; s++) {
+		if ((sp = findsiteprofile(s, e - s)))
+			break;
+		if (!(s = memchr(s, '.', e - s)))
+			return;
+	}
+
+	if (sp->show.len && !nfields) {
+		if (!sel_show)
+			sel_show = ecalloc(1, sizeof(*sel_show));
+		if (!addselectors(sel_show, sp->show.data))
+			errx(1, "invalid selector: %s", sp->show.data);
+		indexselectors(sel_show);
+	}
+	if (sp->hide.len) {
+		if (!sel_hide)
+			sel_hide = ecalloc(1, sizeof(*sel_hide));
+		if (!addselectors(sel_hide, sp->hide.data))
+			errx(1, "invalid selector: %s", sp->hide.data);
+		indexselectors(sel_hide);
+	}
+	if (sp->maxmatches)
+		reader_maxmatches = sp->maxmatches;
+
+	/* match state of the open nodes */
+	for (d = 0; d <= curnode; d++) {
+		if (sel_show)
+			selectorsmatch(sel_show, d);
+		if (sel_hide && selectorsmatch(sel_hide, d))
+			nodes[d].displaytype |= DisplayNone;
+	}
+	if (sel_show && sp->show.len && !nfields)
+		reader_ignore = !sel_show->matched[curnode];
+}
+
+/* value of the first attribute with the name of the node at depth d or
+   NULL */
+static const char *
+nodeattr(int d, const char *name)
+{
+	const char *s, *end, *v;
+
+	s = nodestr(nodes_strings[d].attrs);
+	end = s + nodes_strings[d].attrslen;
+	for (; s < end; s = v + strlen(v) + 1) {
+		v = s + strlen(s) + 1;
+		if (!attrcmp(s, name))
+			return v;
+	}
+	return NULL;
+}
+
+/* parse a field: name=selector[@attribute] */
+static void
+addfield(const char *arg)
+{
+	struct field *f;
+	const char *sel, *a;
+	char *q;
+
+	if (!(sel = strchr(arg, '=')) || sel == arg)
+		errx(1, "invalid field: %s", arg);
+
+	fields = erealloc(fields, (nfields + 1) * sizeof(*fields));
+	f = &fields[nfields++];
+	memset(f, 0, sizeof(*f));
+	f->arg = arg;
+	f->name = estrndup(arg, sel - arg);
+	sel++;
+
+	/* a name after the last '@' is an attribute, a number is an index */
+	q = estrdup(sel);
+	if ((a = strrchr(sel, '@')) && ISALPHA((unsigned char)a[1]) &&
+	    a[1 + strspn(a + 1, "abcdefghijklmnopqrstuvwxyz"
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_:")] == '\0') {
+		f->attr = estrdup(a + 1);
+		q[a - sel] = '\0';
+		selattrs = 1;
+	}
+
+	f->sels = ecalloc(1, sizeof(*f->sels));
+	if (!addselectors(f->sels, q))
+		errx(1, "invalid selector: %s", q);
+	indexselectors(f->sels);
+	free(q);
+}
+
+/* append text to the value of a field, white-space is collapsed */
+static void
+fieldappend(struct field *f, const char *s, size_t len)
+{
+	size_t i, n;
+
+	for (i = 0; i < len; i += n) {
+		for (n = 0; i + n < len && !ISSPACE((unsigned char)s[i + n]); n++)
+			;
+		if (n) {
+			string_append(&f->value, s + i, n);
+			continue;
+		}
+		for (; i + n < len && ISSPACE((unsigned char)s[i + n]); n++)
+			;
+		if (f->value.len && f->value.data[f->value.len - 1] != ' ')
+			string_append(&f->value, " ", 1);
+	}
+}
+
+/* separate the text of block elements in the active fields */
+static void
+extractspace(struct node *cur)
+{
+	size_t i;
+
+	if (!(cur->tag->id == TagBr || (cur->displaytype &
+	    (DisplayBlock | DisplayHeader | DisplayPre | DisplayTable |
+	     DisplayTableRow | DisplayTableCell | DisplayList | DisplayListItem))))
+		return;
+	for (i = 0; i < nfields; i++) {
+		if (fields[i].active)
+			fieldappend(&fields[i], " ", 1);
+	}
+}
+
+/* all fields are set: stop reading the input */
+static void
+extractdone(struct field *f)
+{
+	f->active = 0;
+	f->done = 1;
+	if (++nfieldsdone == nfields) {
+		reader_done = 1;
+		parser.getnext = getnext_eof;
+	}
+}
+
+/* a tag started: match the fields */
+static void
+extractstart(void)
+{
+	struct node *cur = &nodes[curnode];
+	struct field *f;
+	const char *v;
+	size_t i;
+
+	for (i = 0; i < nfields; i++) {
+		f = &fields[i];
+		/* the state of the selectors is updated for each node */
+		if (!selectorsmatch(f->sels, curnode) || f->active || f->done ||
+		    (cur->displaytype & DisplayNone))
+			continue;
+		if (f->attr) {
+			/* the first matching element with the attribute, white-space
+			   is collapsed like text: TAB and newline separate the
+			   values and records */
+			if ((v = nodeattr(curnode, f->attr))) {
+				fieldappend(f, v, strlen(v));
+				extractdone(f);
+			}
+		} else {
+			f->active = 1;
+			f->depth = curnode;
+		}
+	}
+	extractspace(cur);
+}
+
+/* a tag ended: the fields of the node are done */
+static void
+extractend(struct node *cur)
+{
+	size_t i;
+
+	extractspace(cur);
+	for (i = 0; i < nfields; i++) {
+		if (fields[i].active && fields[i].depth == curnode)
+			extractdone(&fields[i]);
+	}
+}
+
+static void
+extractdata(const char *s, size_t len)
+{
+	size_t i;
+
+	if (nodes[curnode].displaytype & DisplayNone)
+		return;
+	for (i = 0; i < nfields; i++) {
+		if (fields[i].active)
+			fieldappend(&fields[i], s, len);
+	}
+}
+
+/* write the fields as a TSV or NDJSON record */
+static void
+printfields(void)
+{
+	String rec = { 0 };
+	struct field *f;
+	const char *s;
+	char buf[8];
+	size_t i, len;
+
+	if (jsonfields)
+		string_append(&rec, "{", 1);
+	for (i = 0; i < nfields; i++) {
+		f = &fields[i];
+		/* white-space is collapsed, trim both ends */
+		s = f->value.data ? f->value.data : "";
+		len = f->value.len;
+		while (len && s[0] == ' ') {
+			s++;
+			len--;
+		}
+		while (len && s[len - 1] == ' ')
+			len--;
+
+		if (!jsonfields) {
+			if (i)
+				string_append(&rec, "\t", 1);
+			string_append(&rec, s, len);
+			continue;
+		}
+
+		if (i)
+			string_append(&rec, ",", 1);
+		string_append(&rec, "\"", 1);
+		string_append(&rec, f->name, strlen(f->name));
+		string_append(&rec, "\":", 2);
+		if (!f->done && !f->active) {
+			string_append(&rec, "null", 4);
+			continue;
+		}
+		string_append(&rec, "\"", 1);
+		for (; len; s++, len--) {
+			if (*s == '"' || *s == '\\') {
+				string_append(&rec, "\\", 1);
+				string_append(&rec, s, 1);
+			} else if ((unsigned char)*s < 0x20) {
+				snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)*s);
+				string_append(&rec, buf, 6);
+			} else {
+				string_append(&rec, s, 1);
+			}
+		}
+		string_append(&rec, "\"", 1);
+	}
+	if (jsonfields)
+		string_append(&rec, "}", 1);
+	string_append(&rec, "\n", 1);
+
+	rawprintf("%s", rec.data);
+	free(rec.data);
+}
+
 static void
 handleinlinealt(void)
 {
 	struct node *cur;
-	char *start, *s, *e;
 
 	/* do not show the alt text if the element is hidden */
 	cur = &nodes[curnode];
-	if (cur->tag.displaytype & DisplayNone)
+	if (cur->displaytype & DisplayNone)
 		return;
 
 	/* show img alt attribute as text. */
 	if (attr_alt.len) {
-		start = attr_alt.data;
-		e = attr_alt.data + attr_alt.len;
-
-		for (s = start; s < e; s++)
-			printc((unsigned char)*s);
+		printtext(attr_alt.data, attr_alt.len);
 		hflush();
-	} else if (cur->tag.id == TagImg && !showurlinline) {
+	} else if (cur->tag->id == TagImg && !showurlinline) {
 		/* if there is no alt text and no URL is shown inline, then
 		   show "[IMG]" to indicate there was an image there */
 		hprint("[IMG]");
 	}
 }
 
-/* lookup a link reference by url in the red-black tree */
-static struct linkref *
-findlinkref(const char *url)
+static void *
+arenaalloc(size_t size)
 {
-	struct linkref find;
+	void *p;
 
-	find.url = (char *)url;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	/* large allocations get their own block */
+	if (size > ARENA_BLOCK_SIZE / 4)
+		return ecalloc(1, size);
+	if (size > arenaleft) {
+		arenap = ecalloc(1, ARENA_BLOCK_SIZE);
+		arenaleft = ARENA_BLOCK_SIZE;
+	}
+	p = arenap;
+	arenap += size;
+	arenaleft -= size;
 
-	return RB_FIND(linkreftree, &linkrefhead, &find);
+	return p;
 }
 
 /* add a link reference. Returns the added link reference, or the existing link
@@ -1411,53 +2998,97 @@ static struct linkref *
 addlinkref(const char *url, const char *_type, enum TagId tagid, int ishidden)
 {
 	struct linkref *link;
-	size_t linknr;
+	size_t linknr, len;
+	uint64_t h = 0;
+
+	len = strlen(url);
 
 	/* if links are deduplicates return the existing link */
-	if (uniqrefs && (link = findlinkref(url)))
-		return link;
+	if (uniqrefs) {
+		h = hash64(0xcbf29ce484222325ULL, url, len);
+		if ((link = hashget(&linkreftable, h, url, len)))
+			return link;
+	}
 
 	if (tagid == TagA)
 		_type = "link";
 
-	link = ecalloc(1, sizeof(*link));
+	link = arenaalloc(sizeof(*link));
 
 	if (!ishidden) {
 		linknr = ++nvisrefs;
 		if (nvisrefs >= ncapvisrefs) {
-			ncapvisrefs += 256; /* greedy alloc */
+			ncapvisrefs = ncapvisrefs ? ncapvisrefs * 2 : 256;
 			visrefs = erealloc(visrefs, sizeof(*visrefs) * ncapvisrefs);
 		}
 		visrefs[linknr - 1] = link; /* add pointer to list */
 	} else {
 		linknr = ++nhiddenrefs;
 		if (nhiddenrefs >= ncaphiddenrefs) {
-			ncaphiddenrefs += 256; /* greedy alloc */
+			ncaphiddenrefs = ncaphiddenrefs ? ncaphiddenrefs * 2 : 256;
 			hiddenrefs = erealloc(hiddenrefs, sizeof(*hiddenrefs) * ncaphiddenrefs);
 		}
 		hiddenrefs[linknr - 1] = link; /* add pointer to list */
 	}
 
-	link->url = estrdup(url);
-	link->type = estrdup(_type);
+	link->url = arenaalloc(len + 1);
+	memcpy(link->url, url, len + 1);
+	link->urllen = len;
+	/* the type is a tag name or a string literal */
+	link->type = _type;
 	link->tagid = tagid;
 	link->ishidden = ishidden;
 	link->linknr = linknr;
 
-	/* add to tree: the tree is only used for checking unique link references */
+	/* the table is only used for checking unique link references */
 	if (uniqrefs)
-		RB_INSERT(linkreftree, &linkrefhead, link);
+		hashput(&linkreftable, h, link->url, len, link);
 
 	return link;
 }
 
+/* Not an absolute URL yet: try to make it absolute using the base href.
+   If it is not possible use the relative URL. Pages repeat the same relative
+   URLs, so the result is memoized */
+static const char *
+resolveurl(const char *url)
+{
+	static String buf;
+	struct urlmemo *m;
+	struct uri u;
+	size_t len;
+	uint64_t h;
+
+	if (!basehrefset || uri_hasscheme(url))
+		return url;
+
+	len = strlen(url);
+	h = hash64(0xcbf29ce484222325ULL, url, len);
+	if ((m = hashget(&urlmemotable, h, url, len)))
+		return m->absurl;
+
+	m = arenaalloc(sizeof(*m));
+	m->url = arenaalloc(len + 1);
+	memcpy(m->url, url, len + 1);
+	m->absurl = m->url;
+
+	if (uri_parse(m->url, &u) != -1) {
+		string_clear(&buf);
+		if (uri_resolve(&buf, &u, &base) != -1) {
+			m->absurl = arenaalloc(buf.len + 1);
+			memcpy(m->absurl, buf.data, buf.len + 1);
+		}
+	}
+	hashput(&urlmemotable, h, m->url, len, m);
+
+	return m->absurl;
+}
+
 static void
 handleinlinelink(void)
 {
-	struct uri newuri, olduri;
 	struct node *cur;
-	char buf[4096], *url;
-	int r;
+	char *url;
 
 	if (!showrefbottom && !showrefinline && !showurlinline && !resources)
 		return; /* there is no need to collect the reference */
@@ -1478,31 +3109,21 @@ handleinlinelink(void)
 	if (*url == '#')
 		return;         /* ignore self-page links */
 
-	/* Not an absolute URL yet: try to make it absolute.
-	   If it is not possible use the relative URL */
-	if (!uri_hasscheme(url) && basehrefset &&
-	    uri_parse(url, &olduri) != -1 &&
-	    uri_makeabs(&newuri, &olduri, &base) != -1 &&
-	    newuri.proto[0]) {
-		r = uri_format(buf, sizeof(buf), &newuri);
-		if (r >= 0 && (size_t)r < sizeof(buf))
-			url = buf;
-	}
-
 	if (!url[0])
 		return;
 
 	cur = &nodes[curnode];
 
-	if (!(cur->tag.displaytype & DisplayNone)) {
+	/* keep the URL as written, it is made absolute when the link is added */
+	if (!(cur->displaytype & DisplayNone)) {
 		string_clear(&nodes_links[curnode]);
 		string_append(&nodes_links[curnode], url, strlen(url));
 	}
 
 	/* add hidden links directly to the reference,
 	   the order doesn't matter */
-	if (cur->tag.displaytype & DisplayNone)
-		addlinkref(url, cur->tag.name, cur->tag.id, 1);
+	if (cur->displaytype & DisplayNone)
+		addlinkref(resolveurl(url), cur->tag->name, cur->tag->id, 1);
 }
 
 static void
@@ -1525,51 +3146,151 @@ printlinkrefs(void)
 		}
 	}
 
-	printf("\n§ References\n\n");
+	rawprintf("\n§ References\n\n");
 
 	for (i = 0; i < nvisrefs; i++) {
 		ref = visrefs[i];
-		printf("• (%zu) %s (%s)\n", ref->linknr, ref->url, ref->type);
+		rawprintf("• (%zu) %s (%s)\n", ref->linknr, ref->url, ref->type);
 	}
 
 	if (nhiddenrefs > 0)
-		printf("\n\nHidden references\n\n");
+		rawprintf("\n\nHidden references\n\n");
 	/* hidden links don't have a link number, just count them */
 	for (i = 0; i < nhiddenrefs; i++) {
 		ref = hiddenrefs[i];
-		printf("• (%zu) %s (%s)\n", ref->linknr, ref->url, ref->type);
+		rawprintf("• (%zu) %s (%s)\n", ref->linknr, ref->url, ref->type);
 	}
 }
 
-/* size to grow node capacity (greedy) */
-#define NODE_CAP_INC 16
+/* initial node capacity, it is doubled when more nodes are needed */
+#define NODE_CAP_INIT 16
 
 /* increase node depth, allocate space for nodes if needed */
 static void
 incnode(void)
 {
-	size_t i;
+	size_t i, inc;
 
 	curnode++;
 
-	if (curnode >= MAX_NODE_DEPTH)
-		errx(1, "max node depth reached: %d", curnode);
-
 	if (curnode >= ncapnodes) {
-		nodes = erealloc(nodes, sizeof(*nodes) * (ncapnodes + NODE_CAP_INC));
-		nodes_links = erealloc(nodes_links, sizeof(*nodes_links) * (ncapnodes + NODE_CAP_INC));
+		inc = ncapnodes; /* grow geometrically */
+		nodes = erealloc(nodes, sizeof(*nodes) * (ncapnodes + inc));
+		nodes_links = erealloc(nodes_links, sizeof(*nodes_links) * (ncapnodes + inc));
+		nodes_strings = erealloc(nodes_strings, sizeof(*nodes_strings) * (ncapnodes + inc));
+		nodes_bloom = erealloc(nodes_bloom, sizeof(*nodes_bloom) * (ncapnodes + inc));
+		nodes_classes = erealloc(nodes_classes, sizeof(*nodes_classes) * (ncapnodes + inc));
 
 		/* clear new region */
-		memset(&nodes[ncapnodes], 0, sizeof(*nodes) * NODE_CAP_INC);
-		memset(&nodes_links[ncapnodes], 0, sizeof(*nodes_links) * NODE_CAP_INC);
-
-		for (i = ncapnodes; i < ncapnodes + NODE_CAP_INC; i++) {
-			nodes[i].tag.displaytype = DisplayInline;
-			nodes[i].tag.name = nodes[i].tagname; /* assign to use fixed-size buffer */
+		memset(&nodes[ncapnodes], 0, sizeof(*nodes) * inc);
+		memset(&nodes_links[ncapnodes], 0, sizeof(*nodes_links) * inc);
+		memset(&nodes_strings[ncapnodes], 0, sizeof(*nodes_strings) * inc);
+		memset(&nodes_classes[ncapnodes], 0, sizeof(*nodes_classes) * inc);
+
+		for (i = ncapnodes; i < ncapnodes + inc; i++) {
+			nodes[i].tag = &unknowntag;
+			nodes[i].displaytype = DisplayInline;
 		}
 
-		ncapnodes += NODE_CAP_INC; /* greedy alloc */
+		ncapnodes += inc;
+	}
+}
+
+/* set the state of the current node which is derived from the parent nodes,
+   so it does not have to be calculated by walking the node tree */
+static void
+inheritnode(void)
+{
+	struct node *cur, *parent;
+
+	cur = &nodes[curnode];
+	parent = &nodes[curnode - 1];
+
+	/* a new node has no data yet */
+	if (datadepth > curnode)
+		datadepth = curnode;
+
+	cur->parentindent = parent->parentindent + parent->indent;
+	cur->parenttypes = parent->parenttypes | parent->displaytype;
+	cur->ndata = countdata(curnode - 1);
+	cur->nlistitemdata = countlistitemdata(curnode - 1);
+	cur->listdepth = (cur->displaytype & DisplayList) ?
+		curnode : parent->listdepth;
+	cur->listitemdepth = (cur->displaytype & DisplayListItem) ?
+		curnode : parent->listitemdepth;
+	cur->containerdepth = (cur->displaytype & (DisplayList|DisplayTable)) ?
+		curnode : parent->containerdepth;
+	cur->tabledepth = (cur->displaytype & DisplayTable) ?
+		curnode : parent->tabledepth;
+	cur->tablerowdepth = (cur->displaytype & DisplayTableRow) ?
+		curnode : parent->tablerowdepth;
+	cur->selectdepth = (cur->displaytype & DisplaySelect) ?
+		curnode : parent->selectdepth;
+	cur->dldepth = (cur->displaytype & DisplayDl) ?
+		curnode : parent->dldepth;
+
+	/* add to the index of open tags */
+	cur->prevsame = opentags[cur->tag->id];
+	opentags[cur->tag->id] = curnode;
+}
+
+/* decrease node depth to depth n, remove the nodes from the index of open
+   tags */
+static void
+decnode(int n)
+{
+	for (; curnode > n; curnode--)
+		opentags[nodes[curnode].tag->id] = nodes[curnode].prevsame;
+}
+
+/* depth of the nearest node of node n (or itself) which has the display type
+   or -1 if there is none. The display type 0 is the root */
+static int
+findparentdepth(int n, int displaytype)
+{
+	switch (displaytype) {
+	case DisplayList:      return nodes[n].listdepth;
+	case DisplayTable:     return nodes[n].tabledepth;
+	case DisplayTableRow:  return nodes[n].tablerowdepth;
+	case DisplaySelect:    return nodes[n].selectdepth;
+	case DisplayDl:        return nodes[n].dldepth;
+	default:               return -1;
+	}
+}
+
+/* depth of the nearest open node with one of the tag ids, if it is after the
+   nearest parent node with the display type, else 0 */
+static int
+findopenchild(const enum TagId *childs, size_t nchilds, int parenttype)
+{
+	size_t j;
+	int i, n = 0;
+
+	for (j = 0; j < nchilds; j++) {
+		i = opentags[childs[j]];
+		if (i > n)
+			n = i;
+	}
+	if (n > findparentdepth(curnode, parenttype))
+		return n;
+	return 0;
+}
+
+/* depth of the nearest open node with the tag t, found is the tag information
+   of t from the tags table or NULL. Returns 0 if there is none */
+static int
+findopentag(const struct tag *found, const char *t)
+{
+	int i;
+
+	if (found)
+		return opentags[found->id];
+	/* unknown tags are linked by tag id 0, compare the tag name */
+	for (i = opentags[0]; i > 0; i = nodes[i].prevsame) {
+		if (isnodetag(i, found, t))
+			return i;
 	}
+	return 0;
 }
 
 static void
@@ -1581,24 +3302,19 @@ static void
 xmldataend(XMLParser *p)
 {
 	struct node *cur;
-	char *start, *s, *e;
 
 	if (!htmldata.data || !htmldata.len)
 		return;
 
 	cur = &nodes[curnode];
 
-	if (reader_ignore || (cur->tag.displaytype & DisplayNone)) {
+	if (reader_ignore || (cur->displaytype & DisplayNone)) {
 		/* print nothing */
-	} else if ((cur->tag.displaytype & DisplayPre) ||
-	           findparenttype(curnode - 1, DisplayPre)) {
+	} else if ((cur->displaytype & DisplayPre) ||
+	           hasparenttype(DisplayPre)) {
 		printpre(htmldata.data, htmldata.len);
 	} else {
-		start = htmldata.data;
-		e = htmldata.data + htmldata.len;
-
-		for (s = start; s < e; s++)
-			printc((unsigned char)*s);
+		printtext(htmldata.data, htmldata.len);
 	}
 
 	string_clear(&htmldata);
@@ -1609,11 +3325,14 @@ xmldata(XMLParser *p, const char *data, size_t datalen)
 {
 	struct node *cur;
 
+	if (nfields)
+		extractdata(data, datalen);
+
 	if (reader_ignore)
 		return;
 
 	cur = &nodes[curnode];
-	if (cur->tag.displaytype & DisplayNone)
+	if (cur->displaytype & DisplayNone)
 		return;
 
 	string_append(&htmldata, data, datalen);
@@ -1626,11 +3345,11 @@ xmldataentity(XMLParser *p, const char *data, size_t datalen)
 	char buf[16];
 	int n;
 
-	if (reader_ignore)
+	if (reader_ignore && !nfields)
 		return;
 
 	cur = &nodes[curnode];
-	if (cur->tag.displaytype & DisplayNone)
+	if (cur->displaytype & DisplayNone)
 		return;
 
 	n = xml_entitytostr(data, buf, sizeof(buf));
@@ -1680,21 +3399,21 @@ findtag(const char *t)
 }
 
 static void
-handleendtag(struct tag *tag)
+handleendtag(const struct tag *tag, int displaytype)
 {
 	int i, marginbottom;
 
-	if (tag->displaytype & DisplayNone)
+	if (displaytype & DisplayNone)
 		return;
 	if (reader_ignore)
 		return;
 
-	if (tag->displaytype & (DisplayButton | DisplayOption)) {
+	if (displaytype & (DisplayButton | DisplayOption)) {
 		hputchar(']');
 		hflush();
 	}
 
-	if (tag->displaytype & (DisplayBlock | DisplayHeader | DisplayTable | DisplayTableRow |
+	if (displaytype & (DisplayBlock | DisplayHeader | DisplayTable | DisplayTableRow |
 		DisplayList | DisplayListItem | DisplayPre)) {
 		endblock(); /* break line if needed */
 	}
@@ -1703,8 +3422,8 @@ handleendtag(struct tag *tag)
 	marginbottom = tag->marginbottom;
 
 	if (marginbottom > 0) {
-		if (tag->displaytype & DisplayList) {
-			if (findparenttype(curnode - 1, DisplayList))
+		if (displaytype & DisplayList) {
+			if (hasparenttype(DisplayList))
 				marginbottom--;
 		}
 	}
@@ -1712,9 +3431,7 @@ handleendtag(struct tag *tag)
 	if (marginbottom > 0) {
 		hflush();
 		for (i = currentnewlines; i < marginbottom; i++) {
-			putchar('\n');
-			nbytesline = 0;
-			ncells = 0;
+			rawnewline();
 			currentnewlines++;
 		}
 		hadnewline = 1;
@@ -1725,23 +3442,24 @@ static void
 endnode(struct node *cur)
 {
 	struct linkref *ref;
-	int i, ishidden;
+	int ishidden;
 
-	/* set a flag indicating the element and its parent containers have data.
-	   This is used for some formatting */
-	if (cur->hasdata) {
-		for (i = curnode; i >= 0; i--)
-			nodes[i].hasdata = 1;
-	}
+	if (nfields)
+		extractend(cur);
 
-	endmarkup(cur->tag.markuptype);
+	/* the element and its parent containers have data, this is used for some
+	   formatting: mark all nodes below the current depth as having data */
+	if (hasdata(cur - nodes) && datadepth <= curnode)
+		datadepth = curnode + 1;
 
-	ishidden = reader_ignore || (cur->tag.displaytype & DisplayNone);
+	endmarkup(cur->tag->markuptype);
+
+	ishidden = reader_ignore || (cur->displaytype & DisplayNone);
 
 	/* add link and show the link number in the visible order */
 	if (!ishidden && nodes_links[curnode].len > 0) {
-		ref = addlinkref(nodes_links[curnode].data,
-			cur->tag.name, cur->tag.id, ishidden);
+		ref = addlinkref(resolveurl(nodes_links[curnode].data),
+			cur->tag->name, cur->tag->id, ishidden);
 
 		if (showrefinline || showurlinline) {
 			hflush();
@@ -1762,16 +3480,60 @@ endnode(struct node *cur)
 		}
 	}
 
-	handleendtag(&(cur->tag));
+	handleendtag(cur->tag, cur->displaytype);
+}
+
+/* end and remove the nodes from the current depth up to and including
+   depth n */
+static void
+closenodes(int n)
+{
+	int i;
+
+	/* the nodes are ended at the current depth, like an end tag */
+	for (i = curnode; i >= n && i > 0; i--)
+		endnode(&nodes[i]);
+	decnode(i);
+}
+
+/* restore the state for the current node after nodes are closed */
+static void
+restorenode(void)
+{
+	indent = calcindent();
+
+#if 0
+	/* check if linewrap is enabled, but currently is disabled and needs to
+	   be restored */
+	if (allowlinewrap && !linewrap && !opentags[TagTable])
+		linewrap = allowlinewrap;
+#endif
+
+	/* restore markup of the tag we are in now */
+	startmarkup(nodes[curnode].tag->markuptype);
+
+	/* check if the current node still matches the visible selector */
+	if (reader_mode && sel_show && !reader_ignore) {
+		if (!sel_show->matched[curnode]) {
+			reader_ignore = 1;
+			newline();
+			/* stop reading the input after the last match ended */
+			if (reader_maxmatches &&
+			    ++reader_nmatches >= reader_maxmatches) {
+				reader_done = 1;
+				parser.getnext = getnext_eof;
+			}
+		}
+	}
 }
 
 static void
 xmltagend(XMLParser *p, const char *t, size_t tl, int isshort)
 {
-	struct tag *found, *tag;
-	enum TagId child, childs[16];
+	const struct tag *found;
+	enum TagId childs[16];
 	size_t nchilds;
-	int i, j, k, nchildfound, parenttype;
+	int i, parenttype;
 
 	/* match tag and lookup metadata */
 	/* ignore closing of void elements, like </br>, which is not allowed */
@@ -1784,9 +3546,7 @@ xmltagend(XMLParser *p, const char *t, size_t tl, int isshort)
 	   in reality the optional tag rules are more complex, see:
            https://html.spec.whatwg.org/multipage/syntax.html#optional-tags */
 
-	child = 0;
 	nchilds = 0;
-	nchildfound = 0;
 	parenttype = 0; /* by default, seek until the root */
 
 	if (found && found->displaytype & DisplayPre) {
@@ -1819,77 +3579,26 @@ xmltagend(XMLParser *p, const char *t, size_t tl, int isshort)
 		parenttype = 0; /* seek until the root */
 	}
 
-	if (nchilds > 0) {
-		for (i = curnode; i >= 0; i--) {
-			if (nchildfound)
-				break;
-			if ((nodes[i].tag.displaytype & parenttype))
-				break;
-			for (j = 0; j < nchilds; j++) {
-				child = childs[j];
-				if (nodes[i].tag.id == child) {
-					/* fake closing the previous tags */
-					for (k = curnode; k >= i; k--)
-						endnode(&nodes[k]);
-					curnode = k;
-					nchildfound = 1;
-					break;
-				}
-			}
-		}
-	}
+	/* fake closing the previous tags */
+	if (nchilds > 0 && (i = findopenchild(childs, nchilds, parenttype)))
+		closenodes(i);
 
 	/* if the current closing tag matches the current open tag */
-	if (nodes[curnode].tag.name &&
-	    !tagcmp(nodes[curnode].tag.name, t)) {
+	if (isnodetag(curnode, found, t)) {
 		endnode(&nodes[curnode]);
 		if (curnode)
-			curnode--;
-	} else {
+			decnode(curnode - 1);
+	} else if ((i = findopentag(found, t))) {
 		/* ... else lookup the first matching start tag. This is also
 		   for handling optional closing tags */
-		tag = NULL;
-		for (i = curnode; i >= 0; i--) {
-			if (nodes[i].tag.name &&
-			    !tagcmp(nodes[i].tag.name, t)) {
-				endnode(&nodes[i]);
-				curnode = i > 0 ? i - 1 : 0;
-				tag = &nodes[i].tag;
-				break;
-			}
-		}
+		endnode(&nodes[i]);
+		decnode(i - 1);
+	} else if (found) {
 		/* unmatched closing tag found */
-		if (!tag && found)
-			handleendtag(found);
+		handleendtag(found, found->displaytype);
 	}
-	indent = calcindent();
 
-#if 0
-	/* check if linewrap is enabled, but currently is disabled and needs to
-	   be restored */
-	if (allowlinewrap && !linewrap) {
-		tag = NULL;
-		for (i = curnode; i >= 0; i--) {
-			if (nodes[i].tag.id == TagTable) {
-				tag = &nodes[i].tag;
-				break;
-			}
-		}
-		if (!tag)
-			linewrap = allowlinewrap;
-	}
-#endif
-
-	/* restore markup of the tag we are in now */
-	startmarkup(nodes[curnode].tag.markuptype);
-
-	/* check if the current node still matches the visible selector */
-	if (reader_mode && sel_show && !reader_ignore) {
-		if (!iscssmatchany(sel_show, nodes, curnode)) {
-			reader_ignore = 1;
-			newline();
-		}
-	}
+	restorenode();
 }
 
 static void
@@ -1898,10 +3607,10 @@ xmltagstart(XMLParser *p, const char *t, size_t tl)
 	struct tag *found;
 	struct node *cur;
 	enum TagId tagid;
-	enum TagId child, childs[16];
+	enum TagId childs[16];
 	size_t nchilds;
 	char *s;
-	int i, j, k, nchildfound, parenttype;
+	int i, k, parenttype;
 
 	cur = &nodes[curnode];
 
@@ -1909,6 +3618,7 @@ xmltagstart(XMLParser *p, const char *t, size_t tl)
 	string_clear(&attr_checked);
 	string_clear(&attr_class);
 	attr_class_set = 0;
+	string_clear(&attr_all);
 	string_clear(&attr_data);
 	string_clear(&attr_href);
 	string_clear(&attr_id);
@@ -1924,9 +3634,7 @@ xmltagstart(XMLParser *p, const char *t, size_t tl)
 	   in reality the optional tag rules are more complex, see:
            https://html.spec.whatwg.org/multipage/syntax.html#optional-tags */
 
-	child = 0;
 	nchilds = 0;
-	nchildfound = 0;
 	parenttype = 0; /* by default, seek until the root */
 
 	/* if optional tag <p> is open and a list element is found, close </p>. */
@@ -1966,7 +3674,7 @@ xmltagstart(XMLParser *p, const char *t, size_t tl)
 			childs[1] = TagDt;
 			nchilds = 2;
 			parenttype = DisplayDl;
-		} else if (tagid == cur->tag.id) {
+		} else if (tagid == cur->tag->id) {
 			/* fake closing the previous tag if it is the same and repeated */
 			xmltagend(p, t, tl, 0);
 		}
@@ -1978,45 +3686,42 @@ xmltagstart(XMLParser *p, const char *t, size_t tl)
 		parenttype = DisplayDl;
 	}
 
-	if (nchilds > 0) {
-		for (i = curnode; i >= 0; i--) {
-			if (nchildfound)
-				break;
-			if ((nodes[i].tag.displaytype & parenttype))
-				break;
-			for (j = 0; j < nchilds; j++) {
-				child = childs[j];
-				if (nodes[i].tag.id == child) {
-					/* fake closing the previous tags */
-					for (k = curnode; k >= i; k--)
-						xmltagend(p, nodes[k].tag.name, strlen(nodes[k].tag.name), 0);
-					nchildfound = 1;
-					break;
-				}
-			}
-		}
+	/* fake closing the previous tags, one at a time like end tags: the
+	   selector match state is checked after each node */
+	if (nchilds > 0 && (i = findopenchild(childs, nchilds, parenttype))) {
+		for (k = curnode; k >= i; k--)
+			xmltagend(p, nodetagname(k), strlen(nodetagname(k)), 0);
 	}
 
+	/* maximum depth reached: flatten the nesting, close the current node so
+	   the new node is added as its sibling */
+	if (curnode >= maxnodedepth)
+		xmltagend(p, nodetagname(curnode), strlen(nodetagname(curnode)), 0);
+
 	incnode();
 	string_clear(&nodes_links[curnode]); /* clear possible link reference for this node */
 	cur = &nodes[curnode];
 	memset(cur, 0, sizeof(*cur)); /* clear / reset node */
-	/* tag defaults */
-	cur->tag.displaytype = DisplayInline;
-	cur->tag.name = cur->tagname; /* assign fixed-size buffer */
-	strlcpy(cur->tagname, t, sizeof(cur->tagname));
-
-	/* force to lowercase */
-	for (s = cur->tagname; *s; s++)
-		*s = TOLOWER((unsigned char)*s);
-
-	/* matched tag: copy tag information to current node */
-	if (found)
-		memcpy(&(cur->tag), found, sizeof(*found));
+	/* matched tag: use tag information for the current node */
+	cur->tag = found ? found : &unknowntag;
+	cur->displaytype = cur->tag->displaytype;
+
+	/* remove the strings of the previous node at this depth */
+	nodes_strpool.len = nodes_strings[curnode - 1].end;
+	memset(&nodes_strings[curnode], 0, sizeof(nodes_strings[curnode]));
+	nodes_strings[curnode].end = nodes_strpool.len;
+	if (!found) {
+		nodes_strings[curnode].tagname = nodestradd(t, tl);
+		/* force to lowercase */
+		for (s = nodes_strpool.data + nodes_strings[curnode].tagname; *s; s++)
+			*s = TOLOWER((unsigned char)*s);
+	}
 
 	/* if parent tag is hidden then hide itself too */
-	if (curnode > 0 && (nodes[curnode - 1].tag.displaytype & DisplayNone))
-		cur->tag.displaytype |= DisplayNone;
+	if (curnode > 0 && (nodes[curnode - 1].displaytype & DisplayNone))
+		cur->displaytype |= DisplayNone;
+
+	inheritnode();
 }
 
 static void
@@ -2057,55 +3762,61 @@ xmltagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
 
 	cur = &nodes[curnode];
 
-	/* copy attributes if set */
-	if (attr_id.len)
-		strlcpy(cur->id, attr_id.data, sizeof(cur->id));
-	else
-		cur->id[0] = '\0';
-	if (attr_class.len)
-		strlcpy(cur->classnames, attr_class.data, sizeof(cur->classnames));
-	else
-		cur->classnames[0] = '\0';
+	/* copy attributes if set, these are only used for selectors */
+	if (reader_mode && attr_id.len)
+		nodes_strings[curnode].id = nodestradd(attr_id.data, attr_id.len);
+	if (reader_mode)
+		nodeclasses(curnode, attr_class.data, attr_class.len);
+	if (selattrs && attr_all.len) {
+		nodes_strings[curnode].attrs = nodestradd(attr_all.data, attr_all.len);
+		nodes_strings[curnode].attrslen = attr_all.len;
+	}
 
 	/* parent node */
 	if (curnode > 0) {
 		parent = &nodes[curnode - 1];
 		parent->nchildren++; /* increase child node count */
 		/* count visible childnodes */
-		if (!(cur->tag.displaytype & DisplayNone))
+		if (!(cur->displaytype & DisplayNone))
 			parent->visnchildren++;
 	} else {
 		parent = NULL;
 	}
 
-	if (reader_mode && sel_show && reader_ignore &&
-	    iscssmatchany(sel_show, nodes, curnode))
+	if (reader_mode)
+		nodebloom(curnode);
+	/* no new match when the last match was ended by this tag implicitly */
+	if (reader_mode && sel_show && !reader_done &&
+	    selectorsmatch(sel_show, curnode))
 		reader_ignore = 0;
 
 	/* hide element */
 	if (reader_mode && sel_hide &&
-	    iscssmatchany(sel_hide, nodes, curnode))
-		cur->tag.displaytype |= DisplayNone;
+	    selectorsmatch(sel_hide, curnode))
+		cur->displaytype |= DisplayNone;
+
+	if (nfields)
+		extractstart();
 
 	/* indent for this tag */
-	cur->indent = cur->tag.indent;
+	cur->indent = cur->tag->indent;
 
-	if (!reader_ignore) {
+	if (!reader_ignore && !reader_done) {
 		/* add link reference, print links and alt text */
 		handleinlinelink();
 		handleinlinealt();
 	}
 
 	/* <select><option> */
-	if (cur->tag.displaytype & DisplayOption) {
+	if (cur->displaytype & DisplayOption) {
 		/* <select multiple>: show all options */
-		if (parent->tag.displaytype & DisplaySelectMulti)
-			cur->tag.displaytype |= DisplayBlock;
+		if (parent->displaytype & DisplaySelectMulti)
+			cur->displaytype |= DisplayBlock;
 		else if (parent->nchildren > 1) /* show the first item as selected */
-			cur->tag.displaytype |= DisplayNone; /* else hide */
+			cur->displaytype |= DisplayNone; /* else hide */
 	}
 
-	if (cur->tag.displaytype & DisplayNone)
+	if (cur->displaytype & DisplayNone)
 		return;
 
 	if (reader_ignore)
@@ -2113,31 +3824,24 @@ xmltagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
 
 	indent = calcindent();
 
-	if ((cur->tag.displaytype & (DisplayBlock | DisplayHeader | DisplayPre |
+	if ((cur->displaytype & (DisplayBlock | DisplayHeader | DisplayPre |
 		DisplayTable | DisplayTableRow |
 		DisplayList | DisplayListItem))) {
 		startblock(); /* break line if needed */
 	}
 
-	if (cur->tag.displaytype & (DisplayButton | DisplayOption)) {
+	if (cur->displaytype & (DisplayButton | DisplayOption)) {
 		hflush();
 		hputchar('[');
 	}
 
-	margintop = cur->tag.margintop;
-	if (cur->tag.displaytype & (DisplayList)) {
-		for (i = curnode - 1; i >= 0; i--) {
-			if (nodes[i].tag.displaytype & DisplayList)
-				break;
-			if (!(nodes[i].tag.displaytype & DisplayListItem))
-				continue;
-			if (nodes[i].hasdata && margintop > 0) {
-				margintop--;
-				break;
-			}
-		}
-	} else if (cur->tag.displaytype & (DisplayBlock|DisplayTable)) {
-		if (!parentcontainerhasdata(cur->tag.displaytype, curnode - 1)) {
+	margintop = cur->tag->margintop;
+	if (cur->displaytype & (DisplayList)) {
+		/* a list item with data after the nearest parent list */
+		if (margintop > 0 && parentlistitemhasdata(curnode - 1))
+			margintop--;
+	} else if (cur->displaytype & (DisplayBlock|DisplayTable)) {
+		if (!parentcontainerhasdata(cur->displaytype, curnode - 1)) {
 			if (margintop > 0)
 				margintop--;
 		}
@@ -2146,37 +3850,35 @@ xmltagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
 	if (margintop > 0) {
 		hflush();
 		for (i = currentnewlines; i < margintop; i++) {
-			putchar('\n');
-			nbytesline = 0;
-			ncells = 0;
+			rawnewline();
 			currentnewlines++;
 		}
 		hadnewline = 1;
 	}
 
-	if (cur->tag.displaytype & DisplayPre) {
+	if (cur->displaytype & DisplayPre) {
 		skipinitialws = 1;
-	} else if (cur->tag.displaytype & DisplayTableCell) {
+	} else if (cur->displaytype & DisplayTableCell) {
 		if (parent && parent->visnchildren > 1)
 			hputchar('\t');
-	} else if (cur->tag.displaytype & DisplayListItem) {
+	} else if (cur->displaytype & DisplayListItem) {
 		/* find first parent node and ordered numbers or unordered */
 		if (parent) {
 			skipinitialws = 0;
 
 			/* print bullet, add columns to indentation level */
-			if (parent->tag.displaytype & DisplayListOrdered) {
+			if (parent->displaytype & DisplayListOrdered) {
 				hprintf("• (%zu) ", parent->nchildren);
 				cur->indent = 6;
 				indent += cur->indent; /* align to number */
-			} else if (parent->tag.displaytype & DisplayList) {
+			} else if (parent->displaytype & DisplayList) {
 				hprint(str_bullet_item);
 				cur->indent = 2;
 				indent += 2; /* align to bullet */
 			}
 		}
 		skipinitialws = 0;
-	} else if (cur->tag.displaytype & DisplayInput) {
+	} else if (cur->displaytype & DisplayInput) {
 		if (!attr_type.len) {
 			hprintf("[%-15s]", attr_value.len ? attr_value.data : ""); /* default: text */
 		} else if (!strcasecmp(attr_type.data, "button")) {
@@ -2194,14 +3896,14 @@ xmltagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
 				attr_checked.len &&
 				!strcasecmp(attr_checked.data, "checked") ? str_radio_checked : " ");
 		} else if (!strcasecmp(attr_type.data, "hidden")) {
-			cur->tag.displaytype |= DisplayNone;
+			cur->displaytype |= DisplayNone;
 		} else {
 			/* unrecognized / default case is text */
 			hprintf("[%-15s]", attr_value.len ? attr_value.data : "");
 		}
-	} else if (cur->tag.displaytype & DisplayHeader) {
+	} else if (cur->displaytype & DisplayHeader) {
 		hflush();
-		switch (cur->tag.id) {
+		switch (cur->tag->id) {
 		case TagH6:
 			hprint(str_section_symbol);
 			/* fallthrought */
@@ -2223,16 +3925,14 @@ xmltagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
 		}
 	}
 
-	startmarkup(cur->tag.markuptype);
+	startmarkup(cur->tag->markuptype);
 
 	/* do not count data such as an item bullet as part of the data for
 	   the node */
 	cur->hasdata = 0;
 
 	if (tagid == TagHr) { /* ruler */
-		i = termwidth - indent - defaultindent;
-		for (; i > 0; i--)
-			hprint(str_ruler);
+		printruler();
 		cur->hasdata = 1; /* treat <hr/> as data */
 	} else if (tagid == TagBr) {
 		hflush();
@@ -2242,7 +3942,7 @@ xmltagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
 	}
 
 	/* autoclose tags, such as <br>, pretend we are <br/> */
-	if (!isshort && cur->tag.isvoid)
+	if (!isshort && cur->tag->isvoid)
 		xmltagend(p, t, tl, 1); /* pretend close of short tag */
 }
 
@@ -2254,11 +3954,14 @@ xmlattr(XMLParser *p, const char *t, size_t tl, const char *n,
 	enum TagId tagid;
 
 	cur = &nodes[curnode];
-	tagid = cur->tag.id;
+	tagid = cur->tag->id;
 
 	/* hide tags with attribute aria-hidden or hidden */
 	if (!attrcmp(n, "aria-hidden") || !attrcmp(n, "hidden"))
-		cur->tag.displaytype |= DisplayNone;
+		cur->displaytype |= DisplayNone;
+
+	if (selattrs)
+		string_append(&attr_all, v, vl);
 
 	if (!attr_class_set && !attrcmp(n, "class")) /* use the first set attribute */
 		string_append(&attr_class, v, vl);
@@ -2277,7 +3980,7 @@ xmlattr(XMLParser *p, const char *t, size_t tl, const char *n,
 		string_append(&attr_href, v, vl);
 
 	if (tagid == TagSelect && !attrcmp(n, "multiple"))
-		cur->tag.displaytype |= DisplaySelectMulti;
+		cur->displaytype |= DisplaySelectMulti;
 
 	if (tagid == TagObject && !attrcmp(n, "data"))
 		string_append(&attr_data, v, vl);
@@ -2286,7 +3989,7 @@ xmlattr(XMLParser *p, const char *t, size_t tl, const char *n,
 	if (tagid == TagImg && !attrcmp(n, "alt"))
 		string_append(&attr_alt, v, vl);
 
-	if (cur->tag.displaytype & DisplayInput && !attrcmp(n, "checked"))
+	if (cur->displaytype & DisplayInput && !attrcmp(n, "checked"))
 		string_append(&attr_checked, v, vl);
 
 	/* src attribute */
@@ -2329,20 +4032,30 @@ xmlattrend(XMLParser *p, const char *t, size_t tl, const char *n,
 	enum TagId tagid;
 
 	cur = &nodes[curnode];
-	tagid = cur->tag.id;
+	tagid = cur->tag->id;
 
 	if (!attr_class_set && !attrcmp(n, "class"))
 		attr_class_set = 1;
 	else if (!attr_id_set && !attrcmp(n, "id"))
 		attr_id_set = 1;
 
+	if (selattrs)
+		string_append(&attr_all, "", 1); /* end of value */
+
 	/* set base URL, if it is set it cannot be overwritten again */
 	if (!basehrefset && basehrefdoc[0] &&
-	    tagid == TagBase && !attrcmp(n, "href"))
-		basehrefset = uri_parse(basehrefdoc, &base) != -1 ? 1 : 0;
+	    tagid == TagBase && !attrcmp(n, "href")) {
+		/* the base refers to its string, keep a copy */
+		free(basehrefsrc);
+		basehrefsrc = estrdup(basehrefdoc);
+		basehrefset = uri_parse(basehrefsrc, &base) != -1 ? 1 : 0;
+		/* the base of -b was applied already and cannot be overwritten */
+		if (basehrefset && siteprofiles.len)
+			applysiteprofile(base.s + base.host.off, base.host.len);
+	}
 
 	/* if attribute checked is set but it has no value then set it to "checked" */
-	if (cur->tag.displaytype & DisplayInput && !attrcmp(n, "checked") && !attr_checked.len)
+	if (cur->displaytype & DisplayInput && !attrcmp(n, "checked") && !attr_checked.len)
 		string_append(&attr_checked, "checked", sizeof("checked") - 1);
 }
 
@@ -2354,7 +4067,12 @@ xmlattrstart(XMLParser *p, const char *t, size_t tl, const char *n,
 	enum TagId tagid;
 
 	cur = &nodes[curnode];
-	tagid = cur->tag.id;
+	tagid = cur->tag->id;
+
+	if (selattrs) {
+		string_append(&attr_all, n, nl);
+		string_append(&attr_all, "", 1); /* end of name */
+	}
 
 	if (!attrcmp(n, "alt"))
 		string_clear(&attr_alt);
@@ -2379,19 +4097,874 @@ xmlattrstart(XMLParser *p, const char *t, size_t tl, const char *n,
 		basehrefdoc[0] = '\0';
 }
 
+/* conversion cache: a cache file is named by the hash of the input and the
+   options. It starts with a header line with a second, independent hash of
+   the same key and the length of the output, which is followed by the output
+   and the resources for fd 3. */
+#define CACHE_VERSION "2" /* part of the key, change it when the output changes */
+#define CACHE_HDRLEN 38 /* 16 hexadecimal digits, a space, 20 digits and a newline */
+#define CACHE_SIZEFILE "size" /* total size of the cache files and time of the last scan */
+#define CACHE_SCANAGE 3600 /* seconds: scan at least this often, temporary files
+                              of this age are from runs which did not finish */
+
+static String input; /* all input data, read when using the cache */
+static String selhiderules; /* data of the file with selectors to hide (-U) */
+static String siteprofilesdata; /* data of the file with per-site profiles (-p) */
+static size_t inputoff;
+static char cachepath[PATH_MAX], cachetmppath[PATH_MAX];
+static uint64_t cachekey[2]; /* FNV-1a hash for the name, second hash to verify */
+static int cachefd = -1, cacheresfd = -1, savedoutfd = -1, savedresfd = -1;
+
+struct cacheentry {
+	char name[32];
+	time_t mtime;
+	off_t size;
+};
+
+static int
+getnext_input(void)
+{
+	if (inputoff >= input.len)
+		return EOF;
+	return (unsigned char)input.data[inputoff++];
+}
+
+static void
+readinput(void)
+{
+	char buf[BUFSIZ];
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+		string_append(&input, buf, n);
+	if (ferror(stdin))
+		err(1, "fread");
+}
+
+static int
+writeall(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len; buf += n, len -= n) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* copy len bytes from the current offset of fd to fd tofd */
+static int
+copyfd(int fd, int tofd, off_t len)
+{
+	char buf[BUFSIZ];
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf))) <= 0)
+			return -1;
+		if (writeall(tofd, buf, n) == -1)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/* 64-bit multiply and xor-shift hash, independent of FNV-1a */
+static uint64_t
+hash64mx(uint64_t h, const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)s[i]) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+/* add data to the key of the cache file */
+static void
+cachekeyadd(const char *s, size_t len)
+{
+	cachekey[0] = hash64(cachekey[0], s, len);
+	cachekey[1] = hash64mx(cachekey[1], s, len);
+}
+
+/* add a field to the cache key prefixed by its length, so the data of a
+   field cannot be taken for the next one. NULL is a field which is not set */
+static void
+cachekeyfield(const char *s, size_t len)
+{
+	char buf[32];
+
+	if (s)
+		snprintf(buf, sizeof(buf), "%zu:", len);
+	else
+		snprintf(buf, sizeof(buf), "-:");
+	cachekeyadd(buf, strlen(buf));
+	cachekeyadd(s, len);
+}
+
+/* the path of the cache file is a hash of the cache version, the input and
+   the options which change the output */
+static void
+cachesetpath(void)
+{
+	char opts[256];
+	size_t i;
+
+	snprintf(opts, sizeof(opts), "%s\t%s\t%d%d%d%d%d%d%d%d%d%d%d\t%d\t%d\t%d\t",
+		str_bullet_item, str_ruler, allowansi, uniqrefs,
+		showrefinline, showurlinline, showrefbottom, allowlinewrap,
+		resources, layoutmode, reflowmode, tokenmode, replaymode,
+		maxnodedepth, termwidth, reader_maxmatches);
+
+	cachekey[0] = 0xcbf29ce484222325ULL;
+	cachekey[1] = 0x243f6a8885a308d3ULL;
+	cachekeyfield(CACHE_VERSION, sizeof(CACHE_VERSION) - 1);
+	cachekeyfield(opts, strlen(opts));
+	cachekeyfield(basehrefarg, basehrefarg ? strlen(basehrefarg) : 0);
+	cachekeyfield(selshowarg, selshowarg ? strlen(selshowarg) : 0);
+	cachekeyfield(selhidearg, selhidearg ? strlen(selhidearg) : 0);
+	cachekeyfield(!selhidefile ? NULL :
+	              selhiderules.data ? selhiderules.data : "", selhiderules.len);
+	cachekeyfield(!siteprofilefile ? NULL :
+	              siteprofilesdata.data ? siteprofilesdata.data : "",
+	              siteprofilesdata.len);
+	cachekeyfield(jsonfields ? "j" : "", jsonfields);
+	for (i = 0; i < nfields; i++)
+		cachekeyfield(fields[i].arg, strlen(fields[i].arg));
+	cachekeyfield(input.data, input.len);
+
+	snprintf(cachepath, sizeof(cachepath), "%s/%016llx", cachedir,
+	         (unsigned long long)cachekey[0]);
+}
+
+/* write the cached output if it exists */
+static int
+cacheload(void)
+{
+	struct stat st;
+	char hdr[CACHE_HDRLEN + 1], *p;
+	off_t outlen;
+	int fd;
+
+	if ((fd = open(cachepath, O_RDONLY)) == -1)
+		return 0;
+	if (fstat(fd, &st) == -1 ||
+	    read(fd, hdr, CACHE_HDRLEN) != CACHE_HDRLEN ||
+	    hdr[CACHE_HDRLEN - 1] != '\n') {
+		close(fd);
+		return 0;
+	}
+	hdr[CACHE_HDRLEN] = '\0';
+	/* a different key with the same name is a miss: it is overwritten */
+	if (strtoull(hdr, &p, 16) != cachekey[1] || *p != ' ') {
+		close(fd);
+		return 0;
+	}
+	outlen = strtoll(p + 1, NULL, 10);
+	if (outlen < 0 || outlen > st.st_size - CACHE_HDRLEN) {
+		close(fd);
+		return 0;
+	}
+
+	if (copyfd(fd, STDOUT_FILENO, outlen) == -1)
+		err(1, "write");
+	if (resources)
+		copyfd(fd, 3, st.st_size - CACHE_HDRLEN - outlen);
+	/* mark as recently used */
+	futimens(fd, NULL);
+	close(fd);
+
+	return 1;
+}
+
+/* create a temporary file in the cache directory, if path is NULL the file
+   is removed immediately */
+static int
+cachemkstemp(char *path, size_t pathsiz)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	if (!path) {
+		path = tmp;
+		pathsiz = sizeof(tmp);
+	}
+	snprintf(path, pathsiz, "%s/tmp.XXXXXX", cachedir);
+	if ((fd = mkstemp(path)) == -1)
+		return -1;
+	if (path == tmp)
+		unlink(tmp);
+	return fd;
+}
+
+/* redirect the output and resources to temporary files */
+static void
+cachebegin(void)
+{
+	char hdr[CACHE_HDRLEN];
+
+	if ((cachefd = cachemkstemp(cachetmppath, sizeof(cachetmppath))) == -1)
+		return; /* no caching, but write the output anyway */
+	memset(hdr, ' ', sizeof(hdr)); /* written at the end */
+	if (resources)
+		cacheresfd = cachemkstemp(NULL, 0);
+	if (writeall(cachefd, hdr, sizeof(hdr)) == -1 ||
+	    (resources && cacheresfd == -1)) {
+		unlink(cachetmppath);
+		close(cachefd);
+		cachefd = -1;
+		return;
+	}
+
+	fflush(stdout);
+	if ((savedoutfd = dup(STDOUT_FILENO)) == -1)
+		err(1, "dup");
+	dup2(cachefd, STDOUT_FILENO);
+	if (resources) {
+		savedresfd = dup(3);
+		dup2(cacheresfd, 3);
+	}
+}
+
+/* remove the least recently used cache files when the size is exceeded */
+static int
+cacheentrycmp(const void *v1, const void *v2)
+{
+	const struct cacheentry *e1 = v1, *e2 = v2;
+
+	if (e1->mtime != e2->mtime)
+		return e1->mtime < e2->mtime ? -1 : 1;
+	return strcmp(e1->name, e2->name);
+}
+
+/* scan the cache directory, remove stale temporary files and remove the least
+   recently used files when the size is exceeded. Returns the total size of
+   the cache files */
+static off_t
+cacheevict(void)
+{
+	struct cacheentry *entries = NULL;
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+	char path[PATH_MAX];
+	size_t i, n = 0, cap = 0;
+	off_t total = 0;
+	time_t now;
+
+	if (!(dp = opendir(cachedir)))
+		return -1;
+	now = time(NULL);
+	while ((d = readdir(dp))) {
+		/* temporary files of runs which were killed */
+		if (!strncmp(d->d_name, "tmp.", 4)) {
+			snprintf(path, sizeof(path), "%s/%s", cachedir, d->d_name);
+			if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+			    now - st.st_mtime > CACHE_SCANAGE)
+				unlink(path);
+			continue;
+		}
+		/* only cache files: 16 hexadecimal digits */
+		if (strlen(d->d_name) != 16 ||
+		    strspn(d->d_name, "0123456789abcdef") != 16)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cachedir, d->d_name);
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		if (n + 1 > cap) {
+			cap = cap ? cap * 2 : 64;
+			entries = erealloc(entries, cap * sizeof(*entries));
+		}
+		strlcpy(entries[n].name, d->d_name, sizeof(entries[n].name));
+		entries[n].mtime = st.st_mtime;
+		entries[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+	closedir(dp);
+
+	/* remove until 3/4 of the maximum size, so this is not needed for each
+	   new cache file */
+	if (total > CACHE_MAXSIZE) {
+		qsort(entries, n, sizeof(*entries), cacheentrycmp);
+		for (i = 0; i < n && total > CACHE_MAXSIZE / 4 * 3; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cachedir, entries[i].name);
+			if (unlink(path) == 0)
+				total -= entries[i].size;
+		}
+	}
+	free(entries);
+
+	return total;
+}
+
+/* add the size of a new cache file to the total in the size file. The cache
+   directory is only scanned when there is no total yet, the maximum size is
+   exceeded or the last scan is too old, the scan also corrects the total */
+static void
+cacheaddsize(off_t size)
+{
+	char path[PATH_MAX], buf[64], *p;
+	off_t total = -1;
+	time_t now, scantime = 0;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", cachedir, CACHE_SIZEFILE);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+		return;
+	/* the lock is released when the file is closed */
+	if (lockf(fd, F_LOCK, 0) == -1) {
+		close(fd);
+		return;
+	}
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[n] = '\0';
+		total = strtoll(buf, &p, 10) + size;
+		scantime = strtoll(p, NULL, 10);
+	}
+	now = time(NULL);
+	if (n <= 0 || total < 0 || total > CACHE_MAXSIZE ||
+	    now - scantime > CACHE_SCANAGE || scantime > now) {
+		total = cacheevict();
+		scantime = now;
+	}
+	if (total >= 0) {
+		n = snprintf(buf, sizeof(buf), "%lld %lld\n", (long long)total,
+		             (long long)scantime);
+		if (ftruncate(fd, 0) == -1 || pwrite(fd, buf, n, 0) != n)
+			unlink(path); /* scan again the next time */
+	}
+	close(fd);
+}
+
+/* restore the output, write the cache file atomically and write the
+   output */
+static void
+cacheend(void)
+{
+	char hdr[CACHE_HDRLEN + 1];
+	off_t outlen, reslen = 0;
+
+	if (cachefd == -1)
+		return;
+
+	fflush(stdout);
+	if (ferror(stdout))
+		err(1, "write");
+	outlen = lseek(cachefd, 0, SEEK_CUR) - CACHE_HDRLEN;
+	dup2(savedoutfd, STDOUT_FILENO);
+	close(savedoutfd);
+	if (resources) {
+		reslen = lseek(cacheresfd, 0, SEEK_CUR);
+		if (savedresfd != -1) {
+			dup2(savedresfd, 3);
+			close(savedresfd);
+		} else {
+			close(3);
+		}
+	}
+
+	snprintf(hdr, sizeof(hdr), "%016llx %020lld\n",
+	         (unsigned long long)cachekey[1], (long long)outlen);
+	if (outlen < 0 || reslen < 0 ||
+	    (resources && (lseek(cacheresfd, 0, SEEK_SET) == -1 ||
+	    copyfd(cacheresfd, cachefd, reslen) == -1)) ||
+	    pwrite(cachefd, hdr, CACHE_HDRLEN, 0) != CACHE_HDRLEN ||
+	    rename(cachetmppath, cachepath) == -1)
+		unlink(cachetmppath);
+	else
+		cacheaddsize(CACHE_HDRLEN + outlen + reslen);
+
+	/* write the output and resources from the cache file */
+	if (lseek(cachefd, CACHE_HDRLEN, SEEK_SET) == -1 ||
+	    copyfd(cachefd, STDOUT_FILENO, outlen) == -1)
+		err(1, "write");
+	if (resources) {
+		lseek(cacheresfd, 0, SEEK_SET);
+		copyfd(cacheresfd, 3, reslen);
+		close(cacheresfd);
+	}
+	close(cachefd);
+}
+
+/* token stream (-t): the events of the parser in a compact binary format,
+   so it can be rendered with -T without parsing the HTML again. It starts
+   with TOKEN_MAGIC, each event is a byte of the type and its fields: names
+   of tags and attributes are symbols and data is a length and the bytes.
+   Numbers are unsigned LEB128. A symbol is its number, the number 0 defines
+   the next symbol and is followed by the length and the name. Attributes and
+   TokTagStartParsed belong to the last started tag and the value chunks to
+   the name of the last TokAttrStart, so these are not repeated. */
+#define TOKEN_MAGIC "webdump tokens 1\n"
+
+enum TokenType {
+	TokTagStart = 1, TokTagStartParsed, TokTagEnd,
+	TokAttrStart, TokAttr, TokAttrEntity, TokAttrEnd,
+	TokDataStart, TokData, TokDataEntity, TokDataEnd,
+	TokCdataStart, TokCdata, TokCdataEnd
+};
+
+struct tokensym {
+	char *name;
+	size_t id;
+};
+
+static FILE *tokenfp;
+static struct hashtable tokensyms; /* the written symbols by name */
+
+static void
+tokenputnum(size_t n)
+{
+	for (; n >= 0x80; n >>= 7)
+		putc((n & 0x7f) | 0x80, tokenfp);
+	putc(n, tokenfp);
+}
+
+static void
+tokenputdata(const char *s, size_t len)
+{
+	tokenputnum(len);
+	fwrite(s, 1, len, tokenfp);
+}
+
+static void
+tokenputsym(const char *s, size_t len)
+{
+	struct tokensym *sym;
+	uint64_t h;
+
+	h = hash64(0xcbf29ce484222325ULL, s, len);
+	if ((sym = hashget(&tokensyms, h, s, len))) {
+		tokenputnum(sym->id);
+		return;
+	}
+	sym = ecalloc(1, sizeof(*sym));
+	sym->name = ecalloc(1, len + 1);
+	memcpy(sym->name, s, len);
+	sym->id = tokensyms.len + 1;
+	hashput(&tokensyms, h, sym->name, len, sym);
+	tokenputnum(0);
+	tokenputdata(s, len);
+}
+
+static void
+tokenattr(XMLParser *p, const char *t, size_t tl, const char *n, size_t nl,
+	const char *v, size_t vl)
+{
+	putc(TokAttr, tokenfp);
+	tokenputdata(v, vl);
+	xmlattr(p, t, tl, n, nl, v, vl);
+}
+
+static void
+tokenattrentity(XMLParser *p, const char *t, size_t tl, const char *n,
+	size_t nl, const char *v, size_t vl)
+{
+	putc(TokAttrEntity, tokenfp);
+	tokenputdata(v, vl);
+	xmlattrentity(p, t, tl, n, nl, v, vl);
+}
+
+static void
+tokenattrstart(XMLParser *p, const char *t, size_t tl, const char *n, size_t nl)
+{
+	putc(TokAttrStart, tokenfp);
+	tokenputsym(n, nl);
+	xmlattrstart(p, t, tl, n, nl);
+}
+
+static void
+tokenattrend(XMLParser *p, const char *t, size_t tl, const char *n, size_t nl)
+{
+	putc(TokAttrEnd, tokenfp);
+	xmlattrend(p, t, tl, n, nl);
+}
+
+static void
+tokencdatastart(XMLParser *p)
+{
+	putc(TokCdataStart, tokenfp);
+	xmlcdatastart(p);
+}
+
+static void
+tokencdata(XMLParser *p, const char *data, size_t datalen)
+{
+	putc(TokCdata, tokenfp);
+	tokenputdata(data, datalen);
+	xmlcdata(p, data, datalen);
+}
+
+static void
+tokencdataend(XMLParser *p)
+{
+	putc(TokCdataEnd, tokenfp);
+	xmlcdataend(p);
+}
+
+static void
+tokendatastart(XMLParser *p)
+{
+	putc(TokDataStart, tokenfp);
+	xmldatastart(p);
+}
+
+static void
+tokendata(XMLParser *p, const char *data, size_t datalen)
+{
+	putc(TokData, tokenfp);
+	tokenputdata(data, datalen);
+	xmldata(p, data, datalen);
+}
+
+static void
+tokendataentity(XMLParser *p, const char *data, size_t datalen)
+{
+	putc(TokDataEntity, tokenfp);
+	tokenputdata(data, datalen);
+	xmldataentity(p, data, datalen);
+}
+
+static void
+tokendataend(XMLParser *p)
+{
+	putc(TokDataEnd, tokenfp);
+	xmldataend(p);
+}
+
+static void
+tokentagstart(XMLParser *p, const char *t, size_t tl)
+{
+	putc(TokTagStart, tokenfp);
+	tokenputsym(t, tl);
+	xmltagstart(p, t, tl);
+}
+
+static void
+tokentagstartparsed(XMLParser *p, const char *t, size_t tl, int isshort)
+{
+	putc(TokTagStartParsed, tokenfp);
+	putc(isshort != 0, tokenfp);
+	xmltagstartparsed(p, t, tl, isshort);
+}
+
+static void
+tokentagend(XMLParser *p, const char *t, size_t tl, int isshort)
+{
+	putc(TokTagEnd, tokenfp);
+	tokenputsym(t, tl);
+	putc(isshort != 0, tokenfp);
+	xmltagend(p, t, tl, isshort);
+}
+
+/* read a number, a symbol or data of the token stream from the input */
+static size_t
+tokengetnum(void)
+{
+	size_t n = 0;
+	int c, shift = 0;
+
+	do {
+		if ((c = getnext_input()) == EOF)
+			errx(1, "tokens: unexpected end of data");
+		if (shift >= (int)sizeof(n) * CHAR_BIT)
+			errx(1, "tokens: invalid number");
+		n |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return n;
+}
+
+static const char *
+tokengetdata(String *buf, size_t *len)
+{
+	*len = tokengetnum();
+	if (*len > input.len - inputoff)
+		errx(1, "tokens: unexpected end of data");
+	string_clear(buf);
+	string_append(buf, input.data + inputoff, *len);
+	inputoff += *len;
+
+	return buf->len ? buf->data : "";
+}
+
+static const char *
+tokengetsym(String **syms, size_t *nsyms, size_t *len)
+{
+	String *sym;
+	size_t id;
+
+	if ((id = tokengetnum())) {
+		if (id > *nsyms)
+			errx(1, "tokens: invalid symbol: %zu", id);
+		sym = &(*syms)[id - 1];
+	} else {
+		*syms = erealloc(*syms, (*nsyms + 1) * sizeof(**syms));
+		sym = &(*syms)[(*nsyms)++];
+		memset(sym, 0, sizeof(*sym));
+		tokengetdata(sym, len);
+	}
+	*len = sym->len;
+
+	return sym->len ? sym->data : "";
+}
+
+/* render the token stream from the input, see TOKEN_MAGIC */
+static void
+tokenreplay(void)
+{
+	String *syms = NULL, data = { 0 };
+	const char *t = "", *n = "", *v;
+	size_t tl = 0, nl = 0, vl, nsyms = 0;
+	int c, isshort;
+
+	if (input.len < sizeof(TOKEN_MAGIC) - 1 ||
+	    memcmp(input.data, TOKEN_MAGIC, sizeof(TOKEN_MAGIC) - 1))
+		errx(1, "tokens: invalid format");
+	inputoff = sizeof(TOKEN_MAGIC) - 1;
+
+	while (!reader_done && (c = getnext_input()) != EOF) {
+		switch (c) {
+		case TokTagStart:
+			t = tokengetsym(&syms, &nsyms, &tl);
+			xmltagstart(&parser, t, tl);
+			break;
+		case TokTagStartParsed:
+		case TokTagEnd:
+			if (c == TokTagEnd)
+				t = tokengetsym(&syms, &nsyms, &tl);
+			if ((isshort = getnext_input()) == EOF)
+				errx(1, "tokens: unexpected end of data");
+			if (c == TokTagStartParsed)
+				xmltagstartparsed(&parser, t, tl, isshort);
+			else
+				xmltagend(&parser, t, tl, isshort);
+			break;
+		case TokAttrStart:
+			n = tokengetsym(&syms, &nsyms, &nl);
+			xmlattrstart(&parser, t, tl, n, nl);
+			break;
+		case TokAttrEnd:
+			xmlattrend(&parser, t, tl, n, nl);
+			break;
+		case TokAttr:
+		case TokAttrEntity:
+			v = tokengetdata(&data, &vl);
+			if (c == TokAttr)
+				xmlattr(&parser, t, tl, n, nl, v, vl);
+			else
+				xmlattrentity(&parser, t, tl, n, nl, v, vl);
+			break;
+		case TokDataStart:
+			xmldatastart(&parser);
+			break;
+		case TokData:
+			v = tokengetdata(&data, &vl);
+			xmldata(&parser, v, vl);
+			break;
+		case TokDataEntity:
+			v = tokengetdata(&data, &vl);
+			xmldataentity(&parser, v, vl);
+			break;
+		case TokDataEnd:
+			xmldataend(&parser);
+			break;
+		case TokCdataStart:
+			xmlcdatastart(&parser);
+			break;
+		case TokCdata:
+			v = tokengetdata(&data, &vl);
+			xmlcdata(&parser, v, vl);
+			break;
+		case TokCdataEnd:
+			xmlcdataend(&parser);
+			break;
+		default:
+			errx(1, "tokens: invalid event: %d", c);
+		}
+	}
+
+	for (; nsyms > 0; nsyms--)
+		free(syms[nsyms - 1].data);
+	free(syms);
+	free(data.data);
+}
+
+/* render the layout format, see layoutrecord() */
+static void
+reflow(const char *data, size_t datalen)
+{
+	const char *line, *e;
+	size_t i, n, len, off = 0;
+
+	/* the text is recorded after the white-space handling */
+	skipinitialws = 0;
+
+	while (off < datalen) {
+		line = data + off;
+		e = memchr(line, '\n', datalen - off);
+		n = e ? (size_t)(e - line) : datalen - off;
+		off += n + (e != NULL);
+
+		switch (line[0]) {
+		case 'I':
+			indent = strtol(line + 1, NULL, 10);
+			break;
+		case 'M':
+			setmarkup(strtol(line + 1, NULL, 10));
+			break;
+		case 'T':
+			for (i = 1; i < n; i++)
+				hputchar(line[i]);
+			break;
+		case 'L':
+			hputchar('\n');
+			break;
+		case 'F':
+			hflush();
+			break;
+		case 'N':
+			rawnewline();
+			break;
+		case 'R':
+			printruler();
+			break;
+		case 'P':
+		case 'X':
+			len = strtoul(line + 1, NULL, 10);
+			if (len > datalen - off)
+				errx(1, "layout: unexpected end of data");
+			if (line[0] == 'P')
+				printpredata(data + off, len);
+			else
+				fwrite(data + off, 1, len, stdout);
+			off += len;
+			break;
+		default:
+			errx(1, "layout: invalid record: %.*s", (int)n, line);
+		}
+	}
+}
+
+/* render the layout for each profile to its own file */
+static void
+renderprofiles(const char *data, size_t len)
+{
+	struct profile *p;
+	size_t i;
+
+	for (i = 0; i < nprofiles; i++) {
+		p = &profiles[i];
+		fflush(stdout);
+		if (dup2(fileno(p->fp), fileno(stdout)) == -1)
+			err(1, "dup2");
+
+		termwidth = p->termwidth;
+		allowansi = p->allowansi;
+		linewrap = allowlinewrap = p->allowlinewrap;
+		render = &renderers[!!linewrap * 2 + !!allowansi];
+
+		/* start with a new output state */
+		indent = 0;
+		nbytesline = ncells = 0;
+		rbuflen = rnbufcells = 0;
+		lbstart = 0;
+		lbprev = -1;
+		hadnewline = currentnewlines = 0;
+		curmarkup = 0;
+
+		reflow(data, len);
+
+		fflush(stdout);
+		if (ferror(stdout) || fclose(p->fp) == EOF)
+			err(1, "write");
+	}
+}
+
+/* read the whole file into s */
+static void
+readfile(const char *path, String *s)
+{
+	FILE *fp;
+	char buf[BUFSIZ];
+	size_t n;
+
+	if (!(fp = fopen(path, "r")))
+		err(1, "fopen: %s", path);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		string_append(s, buf, n);
+	if (ferror(fp))
+		err(1, "fread: %s", path);
+	fclose(fp);
+	if (!s->data)
+		string_append(s, "", 0);
+}
+
 static void
 usage(void)
 {
-	fprintf(stderr, "%s [-8adiIlrx] [-b basehref] [-s selector] [-u selector] [-w termwidth]\n", argv0);
+	fprintf(stderr, "%s [-8adiIjlLrRtTx] [-b basehref] [-c cachedir] [-e name=selector[@attr]] [-m maxdepth] [-n count] [-o outprefix] [-p profiles] [-s selector] [-u selector] [-U file] [-w termwidth[,...]]\n", argv0);
 	exit(1);
 }
 
+/* parse the profiles separated by a comma: a terminal width followed by the
+   flags "a" and "r" which toggle the ANSI and line-wrapping options */
+static void
+parseprofiles(char *arg)
+{
+	struct profile *p;
+	char *s, *e;
+	long w;
+
+	for (s = arg; s; s = e) {
+		if ((e = strchr(s, ',')))
+			*e++ = '\0';
+		profiles = erealloc(profiles, (nprofiles + 1) * sizeof(*profiles));
+		p = &profiles[nprofiles++];
+		p->name = s;
+		p->allowansi = allowansi;
+		p->allowlinewrap = allowlinewrap;
+		p->fp = NULL;
+		if ((w = strtol(s, &s, 10)) < 1 || w > INT_MAX)
+			usage();
+		p->termwidth = w;
+		for (; *s; s++) {
+			if (*s == 'a')
+				p->allowansi = !p->allowansi;
+			else if (*s == 'r')
+				p->allowlinewrap = !p->allowlinewrap;
+			else
+				usage();
+		}
+	}
+
+	if (nprofiles == 1) {
+		termwidth = profiles[0].termwidth;
+		allowansi = profiles[0].allowansi;
+		allowlinewrap = profiles[0].allowlinewrap;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
-	char *basehref;
+	FILE *fp = NULL;
+	char path[PATH_MAX], *layoutdata = NULL;
+	size_t i, layoutlen = 0;
+	int fd;
 
-	if (pledge("stdio", NULL) < 0)
+	if (pledge("stdio rpath wpath cpath fattr", NULL) < 0)
 		err(1, "pledge");
 
 	ARGBEGIN {
@@ -2403,15 +4976,21 @@ main(int argc, char **argv)
 		allowansi = !allowansi;
 		break;
 	case 'b':
-		basehref = EARGF(usage());
-		if (uri_parse(basehref, &base) == -1 ||
-		    !base.proto[0])
+		basehrefarg = EARGF(usage());
+		if (uri_parse(basehrefarg, &base) == -1 ||
+		    !base.proto.len)
 			usage();
 		basehrefset = 1;
 		break;
+	case 'c':
+		cachedir = EARGF(usage());
+		break;
 	case 'd':
 		uniqrefs = !uniqrefs;
 		break;
+	case 'e':
+		addfield(EARGF(usage()));
+		break;
 	case 'i':
 		showrefinline = !showrefinline;
 		break;
@@ -2421,24 +5000,50 @@ main(int argc, char **argv)
 	case 'l':
 		showrefbottom = !showrefbottom;
 		break;
+	case 'j':
+		jsonfields = 1;
+		break;
+	case 'L':
+		layoutmode = 1;
+		break;
+	case 'm':
+		if ((maxnodedepth = strtol(EARGF(usage()), NULL, 10)) < 1)
+			usage();
+		break;
 	case 'r':
 		allowlinewrap = !allowlinewrap;
 		break;
+	case 'R':
+		reflowmode = 1;
+		break;
 	case 's':
-		sel_show = compileselectors(EARGF(usage()));
-		/* switch to reader/selector mode, ignore all data except when matched */
-		reader_mode = 1;
-		reader_ignore = 1;
+		selshowarg = EARGF(usage());
 		break;
 	case 'u':
-		sel_hide = compileselectors(EARGF(usage()));
-		/* switch to reader/selector mode */
-		reader_mode = 1;
+		selhidearg = EARGF(usage());
 		break;
-	case 'w':
-		if ((termwidth = strtol(EARGF(usage()), NULL, 10)) < 1)
+	case 'U':
+		selhidefile = EARGF(usage());
+		break;
+	case 't':
+		tokenmode = 1;
+		break;
+	case 'T':
+		replaymode = 1;
+		break;
+	case 'n':
+		if ((reader_maxmatches = strtol(EARGF(usage()), NULL, 10)) < 1)
 			usage();
 		break;
+	case 'o':
+		outprefix = EARGF(usage());
+		break;
+	case 'p':
+		siteprofilefile = EARGF(usage());
+		break;
+	case 'w':
+		widtharg = EARGF(usage());
+		break;
 	case 'x':
 		resources = !resources;
 		break;
@@ -2446,12 +5051,93 @@ main(int argc, char **argv)
 		usage();
 	} ARGEND
 
+	/* one output and one input format */
+	if (layoutmode + tokenmode > 1 || reflowmode + replaymode > 1 ||
+	    (reflowmode && (layoutmode || tokenmode)))
+		usage();
+
+	if (selshowarg) {
+		sel_show = ecalloc(1, sizeof(*sel_show));
+		if (!addselectors(sel_show, selshowarg))
+			errx(1, "invalid selector: %s", selshowarg);
+		indexselectors(sel_show);
+		/* switch to reader/selector mode, ignore all data except when matched */
+		reader_mode = 1;
+		reader_ignore = 1;
+	}
+	if (selhidefile)
+		readfile(selhidefile, &selhiderules);
+	if (siteprofilefile) {
+		readfile(siteprofilefile, &siteprofilesdata);
+		loadsiteprofiles(siteprofilefile, siteprofilesdata.data);
+		/* keep the attributes of the nodes for the selectors */
+		reader_mode = 1;
+	}
+	if (selhidearg || selhidefile) {
+		sel_hide = ecalloc(1, sizeof(*sel_hide));
+		if (selhidearg && !addselectors(sel_hide, selhidearg))
+			errx(1, "invalid selector: %s", selhidearg);
+		if (selhiderules.len)
+			loadselectors(sel_hide, selhiderules.data);
+		indexselectors(sel_hide);
+		/* switch to reader/selector mode */
+		reader_mode = 1;
+	}
+
+	if (nfields) {
+		if (sel_show)
+			usage();
+		/* write only the fields: ignore all data for the output */
+		reader_mode = 1;
+		reader_ignore = 1;
+	}
+
+	if (widtharg)
+		parseprofiles(widtharg);
+	if (nprofiles > 1) {
+		if (!outprefix || cachedir || layoutmode || tokenmode)
+			usage();
+		for (i = 0; i < nprofiles; i++) {
+			snprintf(path, sizeof(path), "%s%s", outprefix, profiles[i].name);
+			if (!(profiles[i].fp = fopen(path, "w")))
+				err(1, "fopen: %s", path);
+		}
+	}
+
 	linewrap = allowlinewrap;
+	if (allowansi || nprofiles > 1)
+		initsgr();
+	render = &renderers[!!linewrap * 2 + !!allowansi];
 
 	/* initial nodes */
-	ncapnodes = NODE_CAP_INC;
+	ncapnodes = NODE_CAP_INIT;
 	nodes = ecalloc(ncapnodes, sizeof(*nodes));
 	nodes_links = ecalloc(ncapnodes, sizeof(*nodes_links));
+	nodes_strings = ecalloc(ncapnodes, sizeof(*nodes_strings));
+	nodes_bloom = ecalloc(ncapnodes, sizeof(*nodes_bloom));
+	nodes_classes = ecalloc(ncapnodes, sizeof(*nodes_classes));
+	for (i = 1; i < ncapnodes; i++) {
+		nodes[i].tag = &unknowntag;
+		nodes[i].displaytype = DisplayInline;
+	}
+	nodes[0].tag = &roottag;
+	/* empty string at offset 0 for unset strings */
+	string_append(&nodes_strpool, "", 1);
+	nodes_strings[0].end = nodes_strpool.len;
+	nodes[0].listdepth = nodes[0].listitemdepth = nodes[0].containerdepth = -1;
+	nodes[0].tabledepth = nodes[0].tablerowdepth = -1;
+	nodes[0].selectdepth = nodes[0].dldepth = -1;
+	/* match state of the selectors for the root node */
+	if (reader_mode)
+		nodebloom(0);
+	if (sel_show)
+		selectorsmatch(sel_show, 0);
+	if (sel_hide)
+		selectorsmatch(sel_hide, 0);
+	for (i = 0; i < nfields; i++)
+		selectorsmatch(fields[i].sels, 0);
+	if (siteprofiles.len && basehrefarg)
+		applysiteprofile(base.s + base.host.off, base.host.len);
 
 	parser.xmlattrstart = xmlattrstart;
 	parser.xmlattr = xmlattr;
@@ -2469,17 +5155,99 @@ main(int argc, char **argv)
 	parser.xmltagend = xmltagend;
 
 	parser.getnext = getchar;
-	xml_parse(&parser);
+	if (cachedir || reflowmode || replaymode) {
+		readinput();
+		parser.getnext = getnext_input;
+	}
+	if (cachedir) {
+		cachesetpath();
+		if (cacheload())
+			return 0;
+		cachebegin();
+	}
 
-	hflush();
-	if (ncells > 0)
-		newline();
+	/* write the layout format or token stream instead of the output, the
+	   output is still processed for its state. With several profiles the
+	   layout format is written to memory and rendered per profile */
+	if (layoutmode || tokenmode || (nprofiles > 1 && !reflowmode)) {
+		fflush(stdout);
+		if (nprofiles > 1) {
+			if (!(fp = open_memstream(&layoutdata, &layoutlen)))
+				err(1, "open_memstream");
+		} else if ((fd = dup(STDOUT_FILENO)) == -1 || !(fp = fdopen(fd, "w"))) {
+			err(1, "dup");
+		}
+		if (!freopen("/dev/null", "w", stdout))
+			err(1, "freopen");
+	}
+	if (layoutmode || (nprofiles > 1 && !reflowmode)) {
+		layoutfp = fp;
+		render = &renderers[LEN(renderers) - 1];
+	} else if (tokenmode) {
+		tokenfp = fp;
+		fputs(TOKEN_MAGIC, tokenfp);
+		parser.xmlattrstart = tokenattrstart;
+		parser.xmlattr = tokenattr;
+		parser.xmlattrentity = tokenattrentity;
+		parser.xmlattrend = tokenattrend;
+		parser.xmlcdatastart = tokencdatastart;
+		parser.xmlcdata = tokencdata;
+		parser.xmlcdataend = tokencdataend;
+		parser.xmldatastart = tokendatastart;
+		parser.xmldata = tokendata;
+		parser.xmldataentity = tokendataentity;
+		parser.xmldataend = tokendataend;
+		parser.xmltagstart = tokentagstart;
+		parser.xmltagstartparsed = tokentagstartparsed;
+		parser.xmltagend = tokentagend;
+	}
 
-	if (showrefbottom || resources)
-		printlinkrefs();
+	if (!cachedir && pledge("stdio", NULL) < 0)
+		err(1, "pledge");
 
-	hflush();
+	if (reflowmode) {
+		if (nprofiles <= 1)
+			reflow(input.data, input.len);
+	} else {
+		if (replaymode)
+			tokenreplay();
+		else
+			xml_parse(&parser);
+
+		hflush();
+		if (ncells > 0)
+			newline();
+
+		if (showrefbottom || resources)
+			printlinkrefs();
+		if (nfields)
+			printfields();
+
+		hflush();
+	}
 	setmarkup(0);
 
+	if (layoutfp) {
+		layoutflushtext();
+		if (fflush(layoutfp) == EOF || ferror(layoutfp))
+			err(1, "write");
+	}
+	if (tokenfp && (fflush(tokenfp) == EOF || ferror(tokenfp)))
+		err(1, "write");
+
+	if (nprofiles > 1) {
+		if (reflowmode) {
+			renderprofiles(input.data, input.len);
+		} else {
+			fclose(layoutfp);
+			layoutfp = NULL;
+			renderprofiles(layoutdata, layoutlen);
+			free(layoutdata);
+		}
+	}
+
+	if (cachedir)
+		cacheend();
+
 	return 0;
 }